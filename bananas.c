@@ -1,37 +1,215 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <readline/readline.h>
 #include "obj.h"
 #include "parse.h"
 #include "prim.h"
+#include "server.h"
+#include "jit.h"
+#include "vm.h"
 
-extern int g_num_stack_frames; // from obj.c
-extern int g_num_stack_objs; // from obj.c
+// evaluates each line read from fd in a fresh env, printing the results.
+static void worker_main(int fd)
+{
+    FILE* in = fdopen(fd, "r");
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) > 0) {
+        obj_handler_t handler;
+        if (OBJ_TRY(&handler)) {
+            obj_t* env = obj_make_environment(KNULL, g_env);
+            obj_t* result = obj_eval_str(line, env);
+            obj_handler_pop(&handler);
+
+            printf("  ");
+            obj_dump(result, 0);
+            printf("\n");
+        } else {
+            printf("ERROR: %s\n", obj_error_message());
+        }
+        fflush(stdout);
+    }
+    free(line);
+    fclose(in);
+}
+
+// forks worker processes that share the bootstrapped heap, then hands them the
+// lines of stdin round robin, until eof or "quit".
+static int run_workers(int num_workers)
+{
+    obj_prepare_fork();
+
+    int* fds = (int*)malloc(sizeof(int) * num_workers);
+    pid_t* pids = (pid_t*)malloc(sizeof(pid_t) * num_workers);
+    int i;
+    for (i = 0; i < num_workers; i++) {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0) {
+            perror("pipe");
+            break;
+        }
+        fflush(stdout);
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            break;
+        }
+        if (pids[i] == 0) {
+            int j;
+            for (j = 0; j < i; j++)
+                close(fds[j]);  // so the other workers see eof
+            close(pipe_fds[1]);
+            worker_main(pipe_fds[0]);
+            exit(0);
+        }
+        close(pipe_fds[0]);
+        fds[i] = pipe_fds[1];
+    }
+    num_workers = i;
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int next = 0;
+    while (num_workers && (len = getline(&line, &size, stdin)) > 0) {
+        if (strcmp(line, "quit\n") == 0 || strcmp(line, "quit") == 0)
+            break;
+        if (write(fds[next], line, len) != len)
+            perror("write");
+        next = (next + 1) % num_workers;
+    }
+    free(line);
+
+    for (i = 0; i < num_workers; i++)
+        close(fds[i]);
+    for (i = 0; i < num_workers; i++)
+        waitpid(pids[i], NULL, 0);
+    free(fds);
+    free(pids);
+    return 0;
+}
+
+// evaluates the exprs in a file one at a time, in a fresh env where
+// command-line-args is bound to args, as numbers or symbols.  Errors exit.
+static int run_script(const char* filename, int argc, char* argv[])
+{
+    char* str = read_file_str(filename);
+    if (!str) {
+        fprintf(stderr, "could not open \"%s\"\n", filename);
+        return 1;
+    }
+
+    obj_t* args = KNULL;
+    int i;
+    for (i = argc - 1; i >= 0; i--) {
+        char* end;
+        strtod(argv[i], &end);
+        if (*argv[i] && *end == 0)
+            args = obj_cons(obj_make_number2(argv[i], end), args);
+        else
+            args = obj_cons(obj_make_symbol(argv[i]), args);
+    }
+    obj_t* script_env = obj_make_environment(KNULL, g_env);
+    obj_env_define(script_env, obj_make_symbol("command-line-args"), args);
+
+    const char* p = str;
+    obj_t* expr;
+    while ((expr = read_next(&p)))
+        obj_eval_expr(expr, script_env);
+    free(str);
+    return 0;
+}
 
 int main(int argc, char* argv[])
 {
-    obj_init();
+    // bananas [--test] [script.scm [args]]
+    int run_tests = 0;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "--test") == 0) {
+        run_tests = 1;
+        arg++;
+    }
+    const char* script = arg < argc ? argv[arg++] : NULL;
+
+    const char* heap_size = getenv("BANANAS_HEAP_SIZE");
+    const char* heap_growth = getenv("BANANAS_HEAP_GROWTH");
+    const char* heap_max_size = getenv("BANANAS_HEAP_MAX_SIZE");
+    if (heap_size || heap_growth || heap_max_size)
+        obj_set_heap_size(heap_size ? atol(heap_size) : 0,
+                          heap_growth ? atof(heap_growth) : 0,
+                          heap_max_size ? atol(heap_max_size) : 0);
+    const char* gc_threads = getenv("BANANAS_GC_THREADS");
+    if (gc_threads)
+        obj_set_gc_threads(atoi(gc_threads));
+    const char* nursery_size = getenv("BANANAS_GC_NURSERY_SIZE");
+    if (nursery_size)
+        obj_set_nursery_size(atol(nursery_size));
+    const char* gc_pause = getenv("BANANAS_GC_PAUSE_US");
+    if (gc_pause)
+        obj_set_gc_pause(atoi(gc_pause), 1000);
+    const char* concurrent_sweep = getenv("BANANAS_GC_CONCURRENT_SWEEP");
+    if (concurrent_sweep)
+        obj_set_concurrent_sweep(atoi(concurrent_sweep));
+    const char* gc_log = getenv("BANANAS_GC_LOG");
+    if (gc_log)
+        obj_set_gc_log(atoi(gc_log));
+    const char* jit_threshold = getenv("BANANAS_JIT_THRESHOLD");
+    if (jit_threshold)
+        jit_set_threshold(atoi(jit_threshold));
+    const char* perf_map = getenv("BANANAS_JIT_PERF_MAP");
+    if (perf_map)
+        jit_set_perf_map(atoi(perf_map));
+    const char* stack_limit = getenv("BANANAS_STACK_LIMIT");
+    if (stack_limit && atoi(stack_limit) > 0)
+        vm_set_stack_limit(atoi(stack_limit));
+    const char* compact = getenv("BANANAS_GC_COMPACT");
+    int compact_heap = compact && atoi(compact);
 
-    // unit-test
-    PUSHF();
-    obj_t* unit_env = PUSH(obj_make_environment(KNULL, g_env));
-    obj_eval_expr(read_file("unit-test.scm"), unit_env);
-    POPF();
+    const char* image = getenv("BANANAS_IMAGE");
+    if (!image || !obj_init_from_image(image)) {
+        if (image)
+            fprintf(stderr, "could not load image \"%s\", bootstrapping instead\n", image);
+        obj_init();
+    }
+    const char* save_image = getenv("BANANAS_SAVE_IMAGE");
+    if (save_image && !obj_save_image(save_image))
+        fprintf(stderr, "could not save image \"%s\"\n", save_image);
 
-    PUSHF();
-    obj_t* repl_env = PUSH(obj_make_environment(KNULL, g_env));
+    const char* workers = getenv("BANANAS_WORKERS");
+    int num_workers = workers ? atoi(workers) : 0;
+    const char* socket_path = getenv("BANANAS_SOCKET");
+    if (socket_path)
+        return server_run(socket_path, num_workers);
+    if (num_workers > 0)
+        return run_workers(num_workers);
+
+    if (run_tests) {
+        obj_t* unit_env = obj_make_environment(KNULL, g_env);
+        obj_eval_expr(read_file("unit-test.scm"), unit_env);
+        if (!script)
+            return 0;
+    }
+    if (script)
+        return run_script(script, argc - arg, argv + arg);
+
+    obj_t* repl_env = obj_make_environment(KNULL, g_env);
     char* line = NULL;
     while (1) {
 
         printf("   before gc: %d used objs\n", g_num_used_objs);
-        obj_gc();
+        if (compact_heap)
+            obj_compact();
+        else
+            obj_gc();
         printf("   after gc: %d used objs\n", g_num_used_objs);
-        printf("   g_num_stack_frames = %d\n", g_num_stack_frames);
-        printf("   g_num_stack_objs = %d\n", g_num_stack_objs);
 
         line = readline("\\O_o/ > ");
-        if (strcmp(line, "quit") == 0)
+        if (!line || strcmp(line, "quit") == 0)
         {
             free(line);
             break;
@@ -39,15 +217,18 @@ int main(int argc, char* argv[])
         if (line && *line)
             add_history(line);
 
-        PUSHF();
-        obj_t* result = PUSH(obj_eval_str(line, repl_env));
-        free(line);
+        obj_handler_t handler;
+        if (OBJ_TRY(&handler)) {
+            obj_t* result = obj_eval_str(line, repl_env);
+            obj_handler_pop(&handler);
 
-        printf("  ");
-        obj_dump(result, 0);
-        printf("\n");
-        POPF();
+            printf("  ");
+            obj_dump(result, 0);
+            printf("\n");
+        } else {
+            fprintf(stderr, "ERROR: %s\n", obj_error_message());
+        }
+        free(line);
     }
-    POPF();
     return 0;
 }
@@ -0,0 +1,88 @@
+// list walk benchmark for obj_compact, see README.md.
+//
+//     compactbench [cells]
+//
+// Builds a list whose cells are scattered over the heap in random order,
+// walks it, compacts the heap and walks it again.  Prints the best of a few
+// walks before and after.  Run it from the repo, obj_init() reads
+// bootstrap.scm.
+#include "obj.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NUM_WALKS 10
+
+static uint64_t _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// best time of NUM_WALKS walks of list, in ns.
+static uint64_t _walk(obj_t* list, double* sum)
+{
+    uint64_t best = UINT64_MAX;
+    int i;
+    for (i = 0; i < NUM_WALKS; i++) {
+        uint64_t start = _now_ns();
+        double total = 0;
+        obj_t* p;
+        for (p = list; obj_is_pair(p); p = obj_cdr(p))
+            total += obj_number(obj_car(p));
+        uint64_t ns = _now_ns() - start;
+        if (ns < best)
+            best = ns;
+        *sum = total;
+    }
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_cells = argc > 1 ? atoi(argv[1]) : 256 * 1024;
+    if (num_cells < 2) {
+        fprintf(stderr, "usage: %s [cells]\n", argv[0]);
+        return 1;
+    }
+
+    obj_init();
+
+    // the array isn't a root, so the cells are also kept in a list bound in
+    // g_env until they're linked up.
+    obj_t* symbol = obj_make_symbol("compactbench-list");
+    obj_t** cells = (obj_t**)malloc(sizeof(obj_t*) * num_cells);
+    int i;
+    for (i = 0; i < num_cells; i++) {
+        cells[i] = obj_cons(obj_make_number(i), KNULL);
+        obj_env_define(g_env, symbol, obj_cons(cells[i], obj_env_lookup(g_env, symbol)));
+    }
+    srand(1);
+    for (i = num_cells - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        obj_t* cell = cells[i];
+        cells[i] = cells[j];
+        cells[j] = cell;
+    }
+    for (i = 0; i + 1 < num_cells; i++)
+        obj_set_cdr(cells[i], cells[i + 1]);
+    obj_env_define(g_env, symbol, cells[0]);
+    free(cells);
+    obj_gc();
+
+    double sum;
+    uint64_t before = _walk(obj_env_lookup(g_env, symbol), &sum);
+    obj_compact();
+    double sum_after;
+    uint64_t after = _walk(obj_env_lookup(g_env, symbol), &sum_after);
+    if (sum != sum_after) {
+        fprintf(stderr, "compaction changed the list, sum %g, was %g\n", sum_after, sum);
+        return 1;
+    }
+
+    printf("walking %d scattered cells: %.2f ms, after obj_compact: %.2f ms\n",
+           num_cells, before / 1e6, after / 1e6);
+    return 0;
+}
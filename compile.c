@@ -0,0 +1,431 @@
+#include "compile.h"
+#include "vm.h"
+#include "prim.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ops are emitted into one shared buffer.  A lambda's body is compiled in the
+// middle of compiling the code around it, its ops go after the outer code's
+// and are copied out when it's done.  Nothing else compiles while a compile
+// is going on, so compile() starts the buffer over, which also drops what an
+// error left behind.
+static unsigned char* g_ops = NULL;
+static int g_ops_size = 0;
+static int g_ops_capacity = 0;
+
+typedef struct {
+    int start;      // of this code's ops in g_ops
+    obj_t* consts;  // newest first.  A list in the heap, so gc sees them.
+    int num_consts;
+    int depth;      // vm stack slots the ops so far have pushed
+    int max_depth;
+    int num_caches;
+    obj_t* scopes;  // the names of the locals of each lambda the code is in, innermost first
+} compiler_t;
+
+static void _emit(int byte)
+{
+    if (g_ops_size == g_ops_capacity) {
+        g_ops_capacity = g_ops_capacity ? g_ops_capacity * 2 : 4096;
+        g_ops = (unsigned char*)realloc(g_ops, g_ops_capacity);
+        assert(g_ops);
+    }
+    g_ops[g_ops_size++] = (unsigned char)byte;
+}
+
+static void _emit16(int value)
+{
+    if (value < 0 || value > 0xffff)
+        obj_error("expr is too big to compile");
+    _emit(value & 0xff);
+    _emit(value >> 8);
+}
+
+// returns where the operand is, for _patch32().
+static int _emit32(int value)
+{
+    int at = g_ops_size;
+    _emit(value & 0xff);
+    _emit((value >> 8) & 0xff);
+    _emit((value >> 16) & 0xff);
+    _emit((value >> 24) & 0xff);
+    return at;
+}
+
+// points the jump operand at the next op.
+static void _patch32(compiler_t* c, int at)
+{
+    int value = g_ops_size - c->start;
+    g_ops[at] = value & 0xff;
+    g_ops[at + 1] = (value >> 8) & 0xff;
+    g_ops[at + 2] = (value >> 16) & 0xff;
+    g_ops[at + 3] = (value >> 24) & 0xff;
+}
+
+static void _push(compiler_t* c, int n)
+{
+    c->depth += n;
+    if (c->depth > c->max_depth)
+        c->max_depth = c->depth;
+}
+
+// the index of value in the consts, adding it if it isn't there yet.
+static int _const(compiler_t* c, obj_t* value)
+{
+    obj_t* p = c->consts;
+    int i = c->num_consts - 1;
+    for (; obj_is_pair(p); p = obj_cdr(p), i--)
+        if (obj_car(p) == value)
+            return i;
+    c->consts = obj_cons(value, c->consts);
+    return c->num_consts++;
+}
+
+static void _emit_const(compiler_t* c, obj_t* value)
+{
+    _emit(OP_CONST);
+    _emit16(_const(c, value));
+    _push(c, 1);
+}
+
+static void _emit_return(int tail)
+{
+    if (tail)
+        _emit(OP_RETURN);
+}
+
+// finds symbol in the locals of the lambdas in scopes, the last of repeated
+// names like the vm binds them.  The depth counts frames out from the
+// innermost.
+static int _resolve(obj_t* scopes, obj_t* symbol, int* depth, int* index)
+{
+    int d, i;
+    for (d = 0; obj_is_pair(scopes); d++, scopes = obj_cdr(scopes)) {
+        obj_t* names = obj_car(scopes);
+        *index = -1;
+        for (i = 0; obj_is_pair(names); i++, names = obj_cdr(names))
+            if (obj_car(names) == symbol)
+                *index = i;
+        if (*index >= 0) {
+            *depth = d;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the prim form head is bound to, or NULL.  A local is never a form here,
+// a call of one checks what it's bound to when the code runs.
+static form_func_t _form_of(obj_t* scopes, obj_t* head, obj_t* env)
+{
+    int depth, index;
+    if (!obj_is_symbol(head) || _resolve(scopes, head, &depth, &index))
+        return NULL;
+    obj_t** value = obj_env_find(env, head);
+    if (!value || !obj_is_prim_form(*value))
+        return NULL;
+    return (*value)->data.form_func;
+}
+
+// errors unless args is a list of at least n exprs.
+static void _check_args(obj_t* args, int n, const char* form)
+{
+    int i;
+    for (i = 0; i < n; i++, args = obj_cdr(args))
+        if (!obj_is_pair(args))
+            obj_error("bad %s form", form);
+}
+
+static void _compile(compiler_t* c, obj_t* expr, obj_t* env, int tail);
+static obj_t* _compile_code(obj_t* expr, obj_t* env, obj_t* source, obj_t* scopes, obj_t* names, int num_args);
+static obj_t* _compile_lambda(obj_t* scopes, obj_t* formals, obj_t* body, obj_t* env, obj_t* source);
+
+static void _compile_if(compiler_t* c, obj_t* args, obj_t* env, int tail)
+{
+    _check_args(args, 2, "if");
+    _compile(c, obj_car(args), env, 0);
+    _emit(OP_JUMP_IF_FALSE);
+    int else_at = _emit32(0);
+    c->depth--;
+
+    int depth = c->depth;
+    _compile(c, obj_cadr(args), env, tail);
+    int end_at = -1;
+    if (!tail) {
+        _emit(OP_JUMP);
+        end_at = _emit32(0);
+    }
+
+    // a missing else branch is ().
+    c->depth = depth;
+    _patch32(c, else_at);
+    obj_t* rest = obj_cdr(obj_cdr(args));
+    if (obj_is_pair(rest)) {
+        _compile(c, obj_car(rest), env, tail);
+    } else {
+        _emit_const(c, KNULL);
+        _emit_return(tail);
+    }
+    if (end_at >= 0)
+        _patch32(c, end_at);
+}
+
+static void _compile_seq(compiler_t* c, obj_t* exprs, obj_t* env, int tail)
+{
+    if (!obj_is_pair(exprs)) {
+        _emit_const(c, KNULL);
+        _emit_return(tail);
+        return;
+    }
+    while (obj_is_pair(obj_cdr(exprs))) {
+        _compile(c, obj_car(exprs), env, 0);
+        _emit(OP_POP);
+        c->depth--;
+        exprs = obj_cdr(exprs);
+    }
+    _compile(c, obj_car(exprs), env, tail);
+}
+
+// pushes each element, then the tail, and conses them up from the end.
+static void _compile_quasiquote(compiler_t* c, obj_t* quoted, obj_t* env, int tail)
+{
+    obj_t* unquote = obj_make_symbol("unquote");
+    int n = 0;
+    for (; obj_is_pair(quoted); quoted = obj_cdr(quoted), n++) {
+        obj_t* e = obj_car(quoted);
+        if (obj_is_pair(e) && obj_car(e) == unquote) {
+            _check_args(obj_cdr(e), 1, "unquote");
+            _compile(c, obj_cadr(e), env, 0);
+        } else {
+            _emit_const(c, e);
+        }
+    }
+    _emit_const(c, quoted);
+    for (; n > 0; n--) {
+        _emit(OP_CONS);
+        c->depth--;
+    }
+    _emit_return(tail);
+}
+
+// if head is a symbol bound to a proc in env, not a local that could be
+// bound to anything when the code runs.
+static int _is_proc(obj_t* scopes, obj_t* head, obj_t* env)
+{
+    int depth, index;
+    if (!obj_is_symbol(head) || _resolve(scopes, head, &depth, &index))
+        return 0;
+    obj_t** value = obj_env_find(env, head);
+    return value && (obj_is_prim_proc(*value) || obj_is_comp_proc(*value));
+}
+
+// the operator is evaluated first.  Unless it's a symbol bound to a proc now,
+// it could well be a prim form that can only be known to be one when the code
+// runs, so that's checked before the args get evaluated.
+static void _compile_call(compiler_t* c, obj_t* head, obj_t* args, obj_t* env, int tail)
+{
+    int raw = _const(c, args);
+    _compile(c, head, env, 0);
+    int form_at = -1;
+    if (!_is_proc(c->scopes, head, env)) {
+        _emit(OP_FORM);
+        _emit16(raw);
+        form_at = _emit32(0);
+    }
+
+    int n = 0;
+    for (; obj_is_pair(args); args = obj_cdr(args), n++)
+        _compile(c, obj_car(args), env, 0);
+    _emit(tail ? OP_TAIL_CALL : OP_CALL);
+    _emit16(n);
+    _emit16(raw);
+    c->depth -= n;
+
+    if (form_at >= 0) {
+        _patch32(c, form_at);
+        _emit_return(tail);
+    }
+}
+
+static void _compile(compiler_t* c, obj_t* expr, obj_t* env, int tail)
+{
+    obj_check_c_stack();
+    int depth, index;
+    if (obj_is_symbol(expr)) {
+        if (_resolve(c->scopes, expr, &depth, &index)) {
+            _emit(OP_LOCAL);
+            _emit16(depth);
+            _emit16(index);
+        } else {
+            _emit(OP_REF);
+            _emit16(_const(c, expr));
+            _emit16(c->num_caches++);
+        }
+        _push(c, 1);
+        _emit_return(tail);
+        return;
+    }
+    if (!obj_is_pair(expr)) {
+        _emit_const(c, expr);
+        _emit_return(tail);
+        return;
+    }
+
+    obj_t* head = obj_car(expr);
+    obj_t* args = obj_cdr(expr);
+    form_func_t form = _form_of(c->scopes, head, env);
+    if (form == form_quote) {
+        _check_args(args, 1, "quote");
+        _emit_const(c, obj_car(args));
+        _emit_return(tail);
+    } else if (form == form_if) {
+        _compile_if(c, args, env, tail);
+    } else if (form == form_define || form == form_set) {
+        _check_args(args, 2, form == form_define ? "define" : "set!");
+        if (!obj_is_symbol(obj_car(args)))
+            obj_error("can only %s a symbol", form == form_define ? "define" : "set!");
+        obj_t* symbol = obj_car(args);
+        _compile(c, obj_cadr(args), env, 0);
+        if (!_resolve(c->scopes, symbol, &depth, &index)) {
+            _emit(form == form_define ? OP_DEFINE : OP_SET);
+            _emit16(_const(c, symbol));
+        } else if (form == form_set) {
+            _emit(OP_SET_LOCAL);
+            _emit16(depth);
+            _emit16(index);
+        } else if (depth == 0) {
+            _emit(OP_DEFINE_LOCAL);
+            _emit16(index);
+            _emit16(_const(c, symbol));
+        } else {
+            // a define the scan missed, it goes in the frame's plist.
+            _emit(OP_DEFINE);
+            _emit16(_const(c, symbol));
+        }
+        _emit_return(tail);
+    } else if (form == form_begin) {
+        _compile_seq(c, args, env, tail);
+    } else if (form == form_lambda) {
+        _check_args(args, 2, "lambda");
+        obj_t* body = _compile_lambda(c->scopes, obj_car(args), obj_cadr(args), env, expr);
+        _emit(OP_LAMBDA);
+        _emit16(_const(c, obj_car(args)));
+        _emit16(_const(c, body));
+        _push(c, 1);
+        _emit_return(tail);
+    } else if (form == form_quasiquote) {
+        _check_args(args, 1, "quasiquote");
+        _compile_quasiquote(c, obj_car(args), env, tail);
+    } else {
+        _compile_call(c, head, args, env, tail);
+    }
+}
+
+// compiles expr in tail context, into a code obj of its own.  For a lambda
+// body, names are its locals and the first scope.
+static obj_t* _compile_code(obj_t* expr, obj_t* env, obj_t* source, obj_t* scopes, obj_t* names, int num_args)
+{
+    compiler_t c;
+    memset(&c, 0, sizeof(c));
+    c.start = g_ops_size;
+    c.consts = KNULL;
+    c.scopes = scopes;
+    int names_index = _const(&c, names);
+    int num_locals = 0;
+    for (; obj_is_pair(names); names = obj_cdr(names))
+        num_locals++;
+    _compile(&c, expr, env, 1);
+
+    int size = g_ops_size - c.start;
+    bytecode_t head;
+    head.size = size;
+    head.num_consts = c.num_consts;
+    head.num_caches = c.num_caches;
+    bytecode_t* bytecode = (bytecode_t*)malloc(BYTECODE_ALLOC_SIZE(&head));
+    assert(bytecode);
+    bytecode->size = size;
+    bytecode->num_consts = c.num_consts;
+    bytecode->num_caches = c.num_caches;
+    bytecode->max_stack = c.max_depth;
+    bytecode->calls = 0;
+    bytecode->num_args = num_args;
+    bytecode->num_locals = num_locals;
+    bytecode->names = names_index;
+    bytecode->jit = NULL;
+    memset(BYTECODE_CACHES(bytecode), 0, sizeof(ref_cache_t) * c.num_caches);
+    memcpy(BYTECODE_OPS(bytecode), g_ops + c.start, size);
+    g_ops_size = c.start;
+
+    // the consts are filled in once the code obj exists, a gc while making
+    // it could move them.
+    obj_t* code = obj_make_code(source, bytecode);
+    obj_t* p = c.consts;
+    int i = c.num_consts - 1;
+    for (; obj_is_pair(p); p = obj_cdr(p), i--)
+        bytecode->consts[i] = obj_car(p);
+    return code;
+}
+
+// the names expr defines, consed onto names unless they're there already.
+// Defines in the bodies of lambdas in expr are theirs, not these.
+static obj_t* _scan_defines(obj_t* scopes, obj_t* expr, obj_t* env, obj_t* names)
+{
+    obj_check_c_stack();
+    if (!obj_is_pair(expr))
+        return names;
+    form_func_t form = _form_of(scopes, obj_car(expr), env);
+    if (form == form_quote || form == form_lambda)
+        return names;
+    if (form == form_quasiquote) {
+        obj_t* unquote = obj_make_symbol("unquote");
+        obj_t* quoted = obj_is_pair(obj_cdr(expr)) ? obj_cadr(expr) : KNULL;
+        for (; obj_is_pair(quoted); quoted = obj_cdr(quoted)) {
+            obj_t* e = obj_car(quoted);
+            if (obj_is_pair(e) && obj_car(e) == unquote && obj_is_pair(obj_cdr(e)))
+                names = _scan_defines(scopes, obj_cadr(e), env, names);
+        }
+        return names;
+    }
+    if (form == form_define && obj_is_pair(obj_cdr(expr)) && obj_is_symbol(obj_cadr(expr))) {
+        obj_t* p = names;
+        while (obj_is_pair(p) && obj_car(p) != obj_cadr(expr))
+            p = obj_cdr(p);
+        if (!obj_is_pair(p))
+            names = obj_cons(obj_cadr(expr), names);
+    }
+    for (; obj_is_pair(expr); expr = obj_cdr(expr))
+        names = _scan_defines(scopes, obj_car(expr), env, names);
+    return names;
+}
+
+// a lambda's locals are its formals, then the names its body defines.  Every
+// call gets a frame with a slot for each, see vm.h.
+static obj_t* _compile_lambda(obj_t* scopes, obj_t* formals, obj_t* body, obj_t* env, obj_t* source)
+{
+    obj_t* names = KNULL;  // newest first, until they're all in
+    int num_args = 0;
+    for (; obj_is_pair(formals); formals = obj_cdr(formals), num_args++)
+        names = obj_cons(obj_car(formals), names);
+    names = _scan_defines(obj_cons(names, scopes), body, env, names);
+
+    obj_t* reversed = names;
+    int num_locals = 0;
+    for (names = KNULL; obj_is_pair(reversed); reversed = obj_cdr(reversed), num_locals++)
+        names = obj_cons(obj_car(reversed), names);
+    if (num_locals > FRAME_MAX_SLOTS)
+        obj_error("too many locals to compile");
+    return _compile_code(body, env, source, obj_cons(names, scopes), names, num_args);
+}
+
+obj_t* compile(obj_t* expr, obj_t* env)
+{
+    g_ops_size = 0;
+    return _compile_code(expr, env, expr, KNULL, KNULL, 0);
+}
+
+obj_t* compile_lambda(obj_t* formals, obj_t* body, obj_t* env)
+{
+    g_ops_size = 0;
+    return _compile_lambda(KNULL, formals, body, env, body);
+}
@@ -0,0 +1,26 @@
+#ifndef COMPILE_H
+#define COMPILE_H
+
+#include "obj.h"
+
+// the bytecode compiler.  compile() turns an expr into a code obj, which
+// vm_run() runs as many times as it's needed, see vm.h for the ops.
+//
+// Forms are recognized while compiling, a list whose head is a symbol bound
+// to a prim form in env at that point is that form.  Lambda bodies are
+// compiled along with the lambda, into code objs of their own, so making a
+// closure just pairs the body's code with an env.  Exprs in tail context
+// end in a tail call or a return.
+//
+// A lambda's locals, its formals and the names defined in its body, live in
+// the slots of a frame the vm makes for each call.  A local is compiled to
+// its frame depth and slot, anything else is looked up by name when the code
+// runs.  Frames are envs too, eval sees the locals by name, and names that
+// aren't locals get defined in the frame's plist.  Code compiled before such
+// a define won't see it if the name is a local further out.
+
+// both may trigger a gc.
+obj_t* compile(obj_t* expr, obj_t* env);
+obj_t* compile_lambda(obj_t* formals, obj_t* body, obj_t* env);  // the code for a lambda's body
+
+#endif
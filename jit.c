@@ -0,0 +1,779 @@
+#include "jit.h"
+#include "vm.h"
+#include "prim.h"
+#include "symbol.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int g_jit_threshold = 1000;
+static int g_jit_perf_map = 0;
+
+#define JIT_MAX_REGS 16      // xmm0-15, one per vm stack slot
+#define JIT_MAX_BINDINGS 16
+#define JIT_MAX_OPS 4096     // bigger code isn't worth it
+#define JIT_ARENA_SIZE (16 * 1024 * 1024)
+
+typedef double (*jit_entry_t)(const double* args);
+
+typedef struct jit_struct {
+    jit_entry_t entry;   // NULL if the code couldn't be compiled
+    int num_formals;
+    int frame_size;      // c stack a native self call takes
+    int backoff;         // vm calls to skip the native code for, after it ran out of c stack
+    uint64_t serial;     // of the proc the cells were found for, 0 if none
+    unsigned int cells_epoch;  // g_env_cells_epoch when they were
+    int num_bindings;
+    obj_t* symbols[JIT_MAX_BINDINGS];
+    int locals[JIT_MAX_BINDINGS];         // depth << 16 | slot for locals of outer frames, -1 for the rest
+    prim_func_t funcs[JIT_MAX_BINDINGS];  // what they're bound to, NULL for the proc itself
+    obj_t** cells[JIT_MAX_BINDINGS];      // where their values are kept for that proc
+} jit_t;
+
+void jit_set_threshold(int calls)
+{
+    g_jit_threshold = calls;
+}
+
+void jit_set_perf_map(int enabled)
+{
+    g_jit_perf_map = enabled;
+}
+
+void jit_free(jit_t* jit)
+{
+    free(jit);
+}
+
+#if defined(__x86_64__)
+
+enum jit_prim { JIT_ADD, JIT_SUB, JIT_MUL, JIT_DIV, JIT_ABS,
+                JIT_GT, JIT_GTEQ, JIT_EQ, JIT_LT, JIT_LTEQ, JIT_NOT, JIT_SELF };
+
+typedef struct {
+    prim_func_t func;
+    int min_args;  // fewer is an error, the vm reports it
+} jit_prim_info_t;
+
+static jit_prim_info_t s_jit_prims[JIT_SELF] = {
+    [JIT_ADD] = {proc_add, 0},
+    [JIT_SUB] = {proc_sub, 0},
+    [JIT_MUL] = {proc_mul, 0},
+    [JIT_DIV] = {proc_div, 0},
+    [JIT_ABS] = {proc_num_abs, 1},
+    [JIT_GT] = {proc_num_gt, 2},
+    [JIT_GTEQ] = {proc_num_gteq, 2},
+    [JIT_EQ] = {proc_num_eq, 2},
+    [JIT_LT] = {proc_num_lt, 2},
+    [JIT_LTEQ] = {proc_num_lteq, 2},
+    [JIT_NOT] = {proc_not, 1},
+};
+
+// what a vm stack slot holds while translating.  A number is in the xmm
+// register of the slot's index, a proc being called has no register, and
+// a comparison is in the flags until the jump that takes it, a not in
+// between just flips it.
+enum slot_kind { SLOT_NUM, SLOT_PROC, SLOT_CMP };
+
+typedef struct {
+    char kind;
+    char prim;     // enum jit_prim, for procs and comparisons
+    char negated;  // for comparisons
+} slot_t;
+
+static slot_t _slot(int kind, int prim)
+{
+    slot_t slot;
+    slot.kind = kind;
+    slot.prim = prim;
+    slot.negated = 0;
+    return slot;
+}
+
+typedef struct {
+    int depth;  // -1 if nothing jumps here
+    slot_t slots[JIT_MAX_REGS];
+} state_t;
+
+//
+// machine code
+//
+
+static unsigned char* g_code = NULL;
+static int g_code_size = 0;
+static int g_code_capacity = 0;
+
+static void _byte(int byte)
+{
+    if (g_code_size == g_code_capacity) {
+        g_code_capacity = g_code_capacity ? g_code_capacity * 2 : 4096;
+        g_code = (unsigned char*)realloc(g_code, g_code_capacity);
+        assert(g_code);
+    }
+    g_code[g_code_size++] = (unsigned char)byte;
+}
+
+static void _u32(uint32_t value)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        _byte((value >> (i * 8)) & 0xff);
+}
+
+static void _u64(uint64_t value)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        _byte((value >> (i * 8)) & 0xff);
+}
+
+static void _patch32(int at, int value)
+{
+    memcpy(g_code + at, &value, 4);
+}
+
+// an sse op on xmm registers r and s, like addsd r, s.
+static void _sse(int prefix, int op, int r, int s)
+{
+    _byte(prefix);
+    if (r >= 8 || s >= 8)
+        _byte(0x40 | (r >> 3) << 2 | s >> 3);
+    _byte(0x0f);
+    _byte(op);
+    _byte(0xc0 | (r & 7) << 3 | (s & 7));
+}
+
+#define REG_RBP 5
+#define REG_RDI 7
+
+// movsd between xmm register r and [base + disp].
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+static void _movsd_mem(int op, int r, int base, int disp)
+{
+    _byte(0xf2);
+    if (r >= 8)
+        _byte(0x44);
+    _byte(0x0f);
+    _byte(op);
+    _byte(0x80 | (r & 7) << 3 | base);
+    _u32(disp);
+}
+
+static void _movsd(int r, int s)
+{
+    if (r != s)
+        _sse(0xf2, 0x10, r, s);
+}
+
+// loads the bits of a double into xmm register r, thru rax.
+static void _load_bits(int r, uint64_t bits)
+{
+    if (bits == 0) {
+        _sse(0x66, 0x57, r, r);  // xorpd
+        return;
+    }
+    _byte(0x48);  // mov rax, imm64
+    _byte(0xb8);
+    _u64(bits);
+    _byte(0x66);  // movq r, rax
+    _byte(0x48 | (r >> 3) << 2);
+    _byte(0x0f);
+    _byte(0x6e);
+    _byte(0xc0 | (r & 7) << 3);
+}
+
+static void _load_number(int r, double num)
+{
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    _load_bits(r, bits);
+}
+
+// a jump with a rel32 that's patched later, returns where the rel32 is.
+#define JMP -1
+#define JB 0x82
+#define JAE 0x83
+#define JE 0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA 0x87
+#define JP 0x8a
+static int _jump(int cc)
+{
+    if (cc == JMP) {
+        _byte(0xe9);
+    } else {
+        _byte(0x0f);
+        _byte(cc);
+    }
+    _u32(0);
+    return g_code_size - 4;
+}
+
+//
+// the arena and the perf map
+//
+
+static unsigned char* g_arena = NULL;
+static size_t g_arena_used = 0;
+static FILE* g_perf_map_file = NULL;
+static pid_t g_perf_map_pid = 0;
+
+// copies the code into the arena, returns NULL when it's full.
+static void* _install(const char* name)
+{
+    if (!g_arena) {
+        void* p = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        g_arena = (unsigned char*)p;
+    }
+    size_t start = (g_arena_used + 15) & ~(size_t)15;
+    if (start + g_code_size > JIT_ARENA_SIZE)
+        return NULL;
+
+    // the pages are writable only while code is copied in.
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t first = start & ~(page_size - 1);
+    size_t len = ((start + g_code_size + page_size - 1) & ~(page_size - 1)) - first;
+    if (mprotect(g_arena + first, len, PROT_READ | PROT_WRITE))
+        return NULL;
+    memcpy(g_arena + start, g_code, g_code_size);
+    if (mprotect(g_arena + first, len, PROT_READ | PROT_EXEC))
+        return NULL;
+    g_arena_used = start + g_code_size;
+
+    if (g_jit_perf_map) {
+        if (g_perf_map_pid != getpid()) {
+            char path[64];
+            snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+            g_perf_map_file = fopen(path, "a");  // a forked child gets its own
+            g_perf_map_pid = getpid();
+        }
+        if (g_perf_map_file) {
+            fprintf(g_perf_map_file, "%lx %x jit:%s\n", (unsigned long)(g_arena + start), g_code_size, name);
+            fflush(g_perf_map_file);
+        }
+    }
+    return g_arena + start;
+}
+
+//
+// translation
+//
+
+// native code only calls itself, never back into the vm, so there's only
+// ever one native run to unwind out of.
+static jmp_buf g_overflow_jmp;
+
+static void _stack_overflow()
+{
+    longjmp(g_overflow_jmp, 1);
+}
+
+// the frame a local of f's code is in, counting depth from the frame of a
+// call, which f's env is the parent of.
+static obj_t* _local_frame(obj_t* f, int local)
+{
+    obj_t* frame = f->data.comp_proc.env;
+    int depth;
+    for (depth = local >> 16; depth > 1; depth--)
+        frame = frame->data.frame.parent;
+    return frame;
+}
+
+// where symbol's value is kept where f was made, or NULL.
+static obj_t** _binding(obj_t* f, obj_t* symbol, int local)
+{
+    if (local < 0)
+        return obj_env_cache_cell(f->data.comp_proc.env, symbol);
+    return _local_frame(f, local)->data.frame.slots + (local & 0xffff);
+}
+
+// what symbol is bound to where f was made, as an enum jit_prim, or -1 if
+// that isn't something the jit knows.  Known bindings are kept for the
+// checks in jit_call().
+static int _bind(jit_t* jit, obj_t* f, obj_t* symbol, int local)
+{
+    obj_t** binding = _binding(f, symbol, local);
+    if (!binding)
+        return -1;
+    obj_t* value = *binding;
+    int prim = -1;
+    if (value == f) {
+        prim = JIT_SELF;
+    } else if (obj_is_prim_proc(value)) {
+        int i;
+        for (i = 0; i < JIT_SELF; i++)
+            if (s_jit_prims[i].func == value->data.prim_proc.func)
+                prim = i;
+    }
+    if (prim < 0)
+        return -1;
+
+    int i;
+    for (i = 0; i < jit->num_bindings; i++)
+        if (jit->symbols[i] == symbol && jit->locals[i] == local)
+            return prim;
+    if (jit->num_bindings == JIT_MAX_BINDINGS)
+        return -1;
+    jit->symbols[jit->num_bindings] = symbol;
+    jit->locals[jit->num_bindings] = local;
+    jit->funcs[jit->num_bindings] = prim == JIT_SELF ? NULL : s_jit_prims[prim].func;
+    jit->num_bindings++;
+    return prim;
+}
+
+// the cells are found again for each proc, and when g_env_cells_epoch
+// changes, but the values in them are checked every call.
+static int _check_bindings(jit_t* jit, obj_t* f)
+{
+    int i;
+    if (jit->serial != f->data.comp_proc.serial || jit->cells_epoch != g_env_cells_epoch) {
+        jit->serial = 0;
+        for (i = 0; i < jit->num_bindings; i++) {
+            jit->cells[i] = _binding(f, jit->symbols[i], jit->locals[i]);
+            if (!jit->cells[i])
+                return 0;
+        }
+        jit->serial = f->data.comp_proc.serial;
+        jit->cells_epoch = g_env_cells_epoch;
+    }
+    for (i = 0; i < jit->num_bindings; i++) {
+        obj_t* value = *jit->cells[i];
+        if (jit->funcs[i] ? !obj_is_prim_proc(value) || value->data.prim_proc.func != jit->funcs[i] : value != f)
+            return 0;
+    }
+    return 1;
+}
+
+// the frame has a slot per formal, then one per register to spill them
+// around calls.
+#define FORMAL_DISP(I) (-8 * (1 + (I)))
+#define SPILL_DISP(JIT, K) (-8 * (1 + (JIT)->num_formals + (K)))
+
+static int _same_state(state_t* a, state_t* b)
+{
+    return a->depth == b->depth && !memcmp(a->slots, b->slots, sizeof(slot_t) * a->depth);
+}
+
+// records what the stack holds when jumping to target.
+static int _jump_state(state_t* targets, int target, state_t* s)
+{
+    if (targets[target].depth >= 0)
+        return _same_state(&targets[target], s);
+    targets[target] = *s;
+    return 1;
+}
+
+// a binary op like addsd folded over the args into xmm register c.
+static void _fold(int op, int c, int n, double ident)
+{
+    if (n == 0) {
+        _load_number(c, ident);
+        return;
+    }
+    _movsd(c, c + 1);
+    int i;
+    for (i = 1; i < n; i++)
+        _sse(0xf2, op, c, c + 1 + i);
+}
+
+// sign ops are done with a mask in the arg's register.
+static void _sign_op(int op, int c, uint64_t mask)
+{
+    _movsd(c, c + 1);
+    _load_bits(c + 1, mask);
+    _sse(0x66, op, c, c + 1);
+}
+
+#define U16(P) ((P)[0] | (P)[1] << 8)
+#define U32(P) ((uint32_t)(P)[0] | (uint32_t)(P)[1] << 8 | (uint32_t)(P)[2] << 16 | (uint32_t)(P)[3] << 24)
+
+// emits f's code into g_code, returns 0 if it does anything the jit can't.
+// Jumps in the bytecode only go forward, so the stack at every op is known
+// in one pass.
+static int _translate(jit_t* jit, obj_t* f, bytecode_t* bytecode, int* labels, state_t* targets, int* patches)
+{
+    unsigned char* ops = BYTECODE_OPS(bytecode);
+    obj_t** consts = bytecode->consts;
+    int num_patches = 0;
+    int frame = (8 * (jit->num_formals + JIT_MAX_REGS) + 15) & ~15;
+    int i;
+    jit->frame_size = frame + 16;  // and the return address and rbp
+
+    // prologue, native recursion is bounded like the c stack, see jit_call().
+    _byte(0x55);  // push rbp
+    _byte(0x48);  // mov rbp, rsp
+    _byte(0x89);
+    _byte(0xe5);
+    _byte(0x48);  // sub rsp, frame
+    _byte(0x81);
+    _byte(0xec);
+    _u32(frame);
+    _byte(0x48);  // mov rax, limit
+    _byte(0xb8);
+    _u64((uint64_t)(uintptr_t)obj_c_stack_limit());
+    _byte(0x48);  // cmp rsp, rax
+    _byte(0x39);
+    _byte(0xc4);
+    int overflow_at = _jump(JB);
+    for (i = 0; i < jit->num_formals; i++)
+        _movsd_mem(MOVSD_STORE, i, REG_RBP, FORMAL_DISP(i));
+    int loop_start = g_code_size;
+
+    state_t s;
+    s.depth = 0;
+    int dead = 0;
+    int pc = 0;
+    int form_end = -1;  // where the last OP_FORM would have jumped
+    while (pc < bytecode->size) {
+        labels[pc] = g_code_size;
+        if (dead && pc == form_end && ops[pc] == OP_RETURN && targets[pc].depth < 0) {
+            // the return of a form in tail context, which the procs never are.
+            pc += 1;
+            continue;
+        }
+        if (targets[pc].depth >= 0) {
+            if (dead)
+                s = targets[pc];
+            else if (!_same_state(&s, &targets[pc]))
+                return 0;
+            dead = 0;
+        } else if (dead) {
+            return 0;
+        }
+
+        // nothing may clobber the flags before a comparison is taken.
+        if (s.depth > 0 && s.slots[s.depth - 1].kind == SLOT_CMP && ops[pc] != OP_JUMP_IF_FALSE &&
+            ops[pc] != OP_POP && !(ops[pc] == OP_CALL && U16(ops + pc + 1) == 1))
+            return 0;
+
+        switch (ops[pc]) {
+        case OP_CONST:
+        {
+            obj_t* value = consts[U16(ops + pc + 1)];
+            if (!obj_is_number(value) || s.depth == JIT_MAX_REGS)
+                return 0;
+            _load_number(s.depth, obj_number(value));
+            s.slots[s.depth++] = _slot(SLOT_NUM, 0);
+            pc += 3;
+            break;
+        }
+        case OP_REF:
+        {
+            if (s.depth == JIT_MAX_REGS)
+                return 0;
+            int prim = _bind(jit, f, consts[U16(ops + pc + 1)], -1);
+            if (prim < 0)
+                return 0;
+            s.slots[s.depth++] = _slot(SLOT_PROC, prim);
+            pc += 5;
+            break;
+        }
+        case OP_LOCAL:
+        {
+            // the formals are in registers, other locals of the frame are
+            // only there in a frame.  Those further out are bindings.
+            int depth = U16(ops + pc + 1);
+            int index = U16(ops + pc + 3);
+            if (s.depth == JIT_MAX_REGS)
+                return 0;
+            if (depth == 0) {
+                if (index >= jit->num_formals)
+                    return 0;
+                _movsd_mem(MOVSD_LOAD, s.depth, REG_RBP, FORMAL_DISP(index));
+                s.slots[s.depth] = _slot(SLOT_NUM, 0);
+            } else {
+                int local = depth << 16 | index;
+                obj_t* names = _local_frame(f, local)->data.frame.names;
+                int i;
+                for (i = 0; i < index; i++)
+                    names = obj_cdr(names);
+                int prim = _bind(jit, f, obj_car(names), local);
+                if (prim < 0)
+                    return 0;
+                s.slots[s.depth] = _slot(SLOT_PROC, prim);
+            }
+            s.depth++;
+            pc += 5;
+            break;
+        }
+        case OP_FORM:
+            // a proc slot's binding is checked on every call, so it's no form.
+            if (s.depth == 0 || s.slots[s.depth - 1].kind != SLOT_PROC)
+                return 0;
+            form_end = U32(ops + pc + 3);
+            pc += 7;
+            break;
+        case OP_POP:
+            if (s.depth == 0)
+                return 0;
+            s.depth--;
+            pc += 1;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        {
+            int target = U32(ops + pc + 1);
+            if (target <= pc || target >= bytecode->size)
+                return 0;
+            if (ops[pc] == OP_JUMP) {
+                patches[num_patches++] = _jump(JMP);
+                patches[num_patches++] = target;
+                dead = 1;
+            } else {
+                if (s.depth == 0 || s.slots[s.depth - 1].kind != SLOT_CMP)
+                    return 0;
+                s.depth--;
+                int prim = s.slots[s.depth].prim;
+                int strict = prim == JIT_GT || prim == JIT_LT;
+                if (prim == JIT_EQ && !s.slots[s.depth].negated) {
+                    // unordered sets zf too, so a nan is taken as not equal.
+                    patches[num_patches++] = _jump(JNE);
+                    patches[num_patches++] = target;
+                    patches[num_patches++] = _jump(JP);
+                    patches[num_patches++] = target;
+                } else if (prim == JIT_EQ) {
+                    _byte(0x0f);  // jp over the je
+                    _byte(JP);
+                    _u32(6);
+                    patches[num_patches++] = _jump(JE);
+                    patches[num_patches++] = target;
+                } else if (!s.slots[s.depth].negated) {
+                    patches[num_patches++] = _jump(strict ? JBE : JB);
+                    patches[num_patches++] = target;
+                } else {
+                    patches[num_patches++] = _jump(strict ? JA : JAE);
+                    patches[num_patches++] = target;
+                }
+            }
+            if (!_jump_state(targets, target, &s))
+                return 0;
+            pc += 5;
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            int tail = ops[pc] == OP_TAIL_CALL;
+            int n = U16(ops + pc + 1);
+            int c = s.depth - n - 1;
+            if (c < 0 || s.slots[c].kind != SLOT_PROC)
+                return 0;
+            int prim = s.slots[c].prim;
+            if (prim == JIT_NOT) {
+                if (n != 1 || s.slots[c + 1].kind != SLOT_CMP || tail)
+                    return 0;
+                s.slots[c] = s.slots[c + 1];
+                s.slots[c].negated = !s.slots[c].negated;
+                s.depth = c + 1;
+                pc += 5;
+                break;
+            }
+            for (i = c + 1; i < s.depth; i++)
+                if (s.slots[i].kind != SLOT_NUM)
+                    return 0;
+            if (prim == JIT_SELF) {
+                if (n < jit->num_formals)
+                    return 0;
+                if (tail) {
+                    // a loop, the args replace the formals.
+                    for (i = 0; i < jit->num_formals; i++)
+                        _movsd_mem(MOVSD_STORE, c + 1 + i, REG_RBP, FORMAL_DISP(i));
+                    _byte(0xe9);
+                    _u32(loop_start - (g_code_size + 4));
+                    dead = 1;
+                } else {
+                    // every register is the callee's, what's live is spilled.
+                    for (i = 0; i < c; i++)
+                        if (s.slots[i].kind == SLOT_NUM)
+                            _movsd_mem(MOVSD_STORE, i, REG_RBP, SPILL_DISP(jit, i));
+                    for (i = 0; i < jit->num_formals; i++)
+                        _movsd(i, c + 1 + i);
+                    _byte(0xe8);  // call the start
+                    _u32(-(g_code_size + 4));
+                    _movsd(c, 0);
+                    for (i = 0; i < c; i++)
+                        if (s.slots[i].kind == SLOT_NUM)
+                            _movsd_mem(MOVSD_LOAD, i, REG_RBP, SPILL_DISP(jit, i));
+                }
+                s.slots[c] = _slot(SLOT_NUM, 0);
+                s.depth = c + 1;
+                pc += 5;
+                break;
+            }
+
+            if (n < s_jit_prims[prim].min_args)
+                return 0;
+            switch (prim) {
+            case JIT_ADD:
+                _fold(0x58, c, n, 0.0);
+                break;
+            case JIT_SUB:
+                if (n == 1)
+                    _sign_op(0x57, c, 0x8000000000000000ULL);  // xorpd, negates -0 too
+                else
+                    _fold(0x5c, c, n, 0.0);
+                break;
+            case JIT_MUL:
+                _fold(0x59, c, n, 1.0);
+                break;
+            case JIT_DIV:
+                _fold(0x5e, c, n, 1.0);
+                break;
+            case JIT_ABS:
+                _sign_op(0x54, c, 0x7fffffffffffffffULL);  // andpd
+                break;
+            default:
+                // the prims only look at the first two args.
+                if (tail)
+                    return 0;
+                if (prim == JIT_LT || prim == JIT_LTEQ)
+                    _sse(0x66, 0x2e, c + 2, c + 1);  // ucomisd
+                else
+                    _sse(0x66, 0x2e, c + 1, c + 2);
+                break;
+            }
+            s.slots[c] = prim >= JIT_GT ? _slot(SLOT_CMP, prim) : _slot(SLOT_NUM, 0);
+            s.depth = c + 1;
+            pc += 5;
+            if (tail) {
+                // in xmm0, since nothing's under the proc in tail context.
+                if (c != 0)
+                    return 0;
+                patches[num_patches++] = _jump(JMP);
+                patches[num_patches++] = bytecode->size;
+                dead = 1;
+            }
+            break;
+        }
+        case OP_RETURN:
+            if (s.depth == 0 || s.slots[s.depth - 1].kind != SLOT_NUM)
+                return 0;
+            _movsd(0, s.depth - 1);
+            patches[num_patches++] = _jump(JMP);
+            patches[num_patches++] = bytecode->size;
+            dead = 1;
+            pc += 1;
+            break;
+        default:
+            return 0;
+        }
+    }
+    if (!dead)
+        return 0;
+
+    // the epilogue is where the end of the ops would be.
+    labels[bytecode->size] = g_code_size;
+    _byte(0xc9);  // leave
+    _byte(0xc3);  // ret
+    _patch32(overflow_at, g_code_size - (overflow_at + 4));
+    _byte(0x48);  // mov rax, _stack_overflow
+    _byte(0xb8);
+    _u64((uint64_t)(uintptr_t)_stack_overflow);
+    _byte(0xff);  // call rax, which doesn't return
+    _byte(0xd0);
+
+    for (i = 0; i < num_patches; i += 2) {
+        int at = patches[i];
+        int target = labels[patches[i + 1]];
+        if (target < 0)
+            return 0;
+        _patch32(at, target - (at + 4));
+    }
+    return 1;
+}
+
+// compiles f's code, the jit_t says if that didn't work.
+static jit_t* _compile(obj_t* f, bytecode_t* bytecode)
+{
+    jit_t* jit = (jit_t*)calloc(1, sizeof(jit_t));
+    assert(jit);
+    jit->num_formals = bytecode->num_args;
+    if (jit->num_formals > JIT_MAX_REGS || bytecode->max_stack > JIT_MAX_REGS || bytecode->size > JIT_MAX_OPS)
+        return jit;
+
+    int* labels = (int*)malloc(sizeof(int) * (bytecode->size + 1));
+    state_t* targets = (state_t*)malloc(sizeof(state_t) * (bytecode->size + 1));
+    int* patches = (int*)malloc(sizeof(int) * bytecode->size * 2);  // at most 2 per 5 bytes of ops
+    assert(labels && targets && patches);
+    int i;
+    for (i = 0; i <= bytecode->size; i++) {
+        labels[i] = -1;
+        targets[i].depth = -1;
+    }
+
+    g_code_size = 0;
+    if (_translate(jit, f, bytecode, labels, targets, patches)) {
+        // the entry called from c takes the args in an array and moves them
+        // into registers.
+        int start = g_code_size;
+        for (i = 0; i < jit->num_formals; i++)
+            _movsd_mem(MOVSD_LOAD, i, REG_RDI, 8 * i);
+        _byte(0xe9);
+        _u32(-(g_code_size + 4));
+
+        // named after the symbol it calls itself by, if it does.
+        const char* name = "lambda";
+        for (i = 0; i < jit->num_bindings; i++)
+            if (!jit->funcs[i])
+                name = symbol_get(jit->symbols[i]->data.symbol);
+        unsigned char* code = (unsigned char*)_install(name);
+        if (code)
+            jit->entry = (jit_entry_t)(code + start);
+    }
+    free(labels);
+    free(targets);
+    free(patches);
+    return jit;
+}
+
+int jit_call(obj_t* f, int argc, obj_t** argv, obj_t** result)
+{
+    bytecode_t* bytecode = f->data.comp_proc.body->data.code.bytecode;
+    jit_t* jit = bytecode->jit;
+    if (!jit)
+        jit = bytecode->jit = _compile(f, bytecode);
+    if (!jit->entry || argc < jit->num_formals)
+        return 0;
+    if (jit->backoff) {
+        jit->backoff--;
+        return 0;
+    }
+    if (!_check_bindings(jit, f))
+        return 0;
+
+    double args[JIT_MAX_REGS];
+    int i;
+    for (i = 0; i < jit->num_formals; i++) {
+        if (!obj_is_number(argv[i]))
+            return 0;
+        args[i] = obj_number(argv[i]);
+    }
+    // recursion too deep for the c stack unwinds back here and the vm runs
+    // the bytecode instead, the native code has no side effects to redo.
+    // The vm's next calls to it are as deep again, so they skip the native
+    // code for about as many calls as it got thru, which keeps a deep
+    // recursion linear.
+    char* sp = (char*)__builtin_frame_address(0);
+    if (setjmp(g_overflow_jmp)) {
+        jit->backoff = (int)((sp - obj_c_stack_limit()) / jit->frame_size);
+        return 0;
+    }
+    *result = obj_make_number(jit->entry(args));
+    return 1;
+}
+
+#else
+
+int jit_call(obj_t* f, int argc, obj_t** argv, obj_t** result)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "obj.h"
+
+// the x86-64 jit.  The vm counts calls to each comp_proc's code, and once
+// that gets to the threshold the code is compiled to machine code, if it
+// only does arithmetic and comparisons on its args and number constants and
+// calls itself.  Values are unboxed doubles kept in sse registers, a vm
+// stack slot maps to a register.  A call through the jit checks that the
+// args are numbers and that the prims and the proc itself are still bound
+// where they were, and returns 0 to let the vm run the bytecode otherwise.
+//
+// Native code isn't freed, it's in an arena that stops taking code when
+// it's full.
+
+void jit_set_threshold(int calls);  // 0 turns the jit off
+void jit_set_perf_map(int enabled);  // writes /tmp/perf-<pid>.map for perf
+
+// the vm bumps bytecode->calls up to this, then calls jit_call().
+extern int g_jit_threshold;
+
+// never triggers a gc.
+int jit_call(obj_t* f, int argc, obj_t** argv, obj_t** result);
+
+void jit_free(struct jit_struct* jit);
+
+#endif
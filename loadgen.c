@@ -0,0 +1,213 @@
+// load generator for the eval server, see server.h.
+//
+//     loadgen [-c connections] [-n requests] [-p pipeline depth] [-e expr] socket
+//
+// Sends requests total over the connections, keeping up to depth of them in
+// flight on each, and reports throughput and latency.  A request's latency is
+// from when it was written to when its reply was read.
+#include "server.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#define READ_SIZE (64 * 1024)
+
+typedef struct {
+    int fd;
+    uint64_t* sent_ns;  // ring of send times of the requests in flight
+    int head;
+    int num_in_flight;
+    char* in;
+    size_t in_len;
+    size_t in_capacity;
+} conn_t;
+
+static uint64_t _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int _compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int _connect(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void _write_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int num_conns = 1;
+    int num_requests = 100000;
+    int depth = 1;
+    const char* expr = "(+ 1 2)";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:p:e:")) != -1) {
+        switch (opt) {
+        case 'c': num_conns = atoi(optarg); break;
+        case 'n': num_requests = atoi(optarg); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'e': expr = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-c connections] [-n requests] [-p pipeline depth] [-e expr] socket\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || num_conns < 1 || num_requests < 1 || depth < 1) {
+        fprintf(stderr, "usage: %s [-c connections] [-n requests] [-p pipeline depth] [-e expr] socket\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    // one frame, repeated depth times so a full window goes out in one write.
+    size_t expr_len = strlen(expr);
+    size_t frame_size = 4 + expr_len;
+    char* frames = (char*)malloc(frame_size * depth);
+    uint32_t frame_len = htonl((uint32_t)expr_len);
+    int i;
+    for (i = 0; i < depth; i++) {
+        memcpy(frames + i * frame_size, &frame_len, 4);
+        memcpy(frames + i * frame_size + 4, expr, expr_len);
+    }
+
+    conn_t* conns = (conn_t*)calloc(num_conns, sizeof(conn_t));
+    struct pollfd* fds = (struct pollfd*)malloc(sizeof(struct pollfd) * num_conns);
+    for (i = 0; i < num_conns; i++) {
+        conns[i].fd = _connect(path);
+        conns[i].sent_ns = (uint64_t*)malloc(sizeof(uint64_t) * depth);
+        conns[i].in_capacity = READ_SIZE;
+        conns[i].in = (char*)malloc(conns[i].in_capacity);
+        fds[i].fd = conns[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    uint64_t* latencies = (uint64_t*)malloc(sizeof(uint64_t) * num_requests);
+    int num_sent = 0;
+    int num_done = 0;
+    int num_errors = 0;
+    uint64_t start_ns = _now_ns();
+    while (num_done < num_requests) {
+        // top up every connection's window.
+        for (i = 0; i < num_conns; i++) {
+            conn_t* conn = &conns[i];
+            int n = depth - conn->num_in_flight;
+            if (n > num_requests - num_sent)
+                n = num_requests - num_sent;
+            if (n <= 0)
+                continue;
+            uint64_t now = _now_ns();
+            int j;
+            for (j = 0; j < n; j++)
+                conn->sent_ns[(conn->head + conn->num_in_flight + j) % depth] = now;
+            conn->num_in_flight += n;
+            num_sent += n;
+            _write_all(conn->fd, frames, frame_size * n);
+        }
+
+        if (poll(fds, num_conns, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+        for (i = 0; i < num_conns; i++) {
+            if (!fds[i].revents)
+                continue;
+            conn_t* conn = &conns[i];
+            if (conn->in_capacity - conn->in_len < READ_SIZE) {
+                conn->in_capacity *= 2;
+                conn->in = (char*)realloc(conn->in, conn->in_capacity);
+            }
+            ssize_t len = read(conn->fd, conn->in + conn->in_len, conn->in_capacity - conn->in_len);
+            if (len <= 0) {
+                fprintf(stderr, "server closed the connection\n");
+                return 1;
+            }
+            conn->in_len += len;
+            uint64_t now = _now_ns();
+
+            size_t pos = 0;
+            while (conn->in_len - pos >= 4) {
+                uint32_t reply_len;
+                memcpy(&reply_len, conn->in + pos, 4);
+                reply_len = ntohl(reply_len);
+                if (conn->in_len - pos - 4 < reply_len)
+                    break;
+                if (reply_len < 1 || conn->in[pos + 4] != SERVER_OK) {
+                    if (num_errors == 0)
+                        fprintf(stderr, "error: %.*s\n", (int)reply_len - 1, conn->in + pos + 5);
+                    num_errors++;
+                }
+                latencies[num_done++] = now - conn->sent_ns[conn->head];
+                conn->head = (conn->head + 1) % depth;
+                conn->num_in_flight--;
+                pos += 4 + reply_len;
+            }
+            memmove(conn->in, conn->in + pos, conn->in_len - pos);
+            conn->in_len -= pos;
+        }
+    }
+    uint64_t elapsed_ns = _now_ns() - start_ns;
+
+    qsort(latencies, num_requests, sizeof(uint64_t), _compare_u64);
+    uint64_t total_ns = 0;
+    for (i = 0; i < num_requests; i++)
+        total_ns += latencies[i];
+    printf("%d requests, %d connections, pipeline depth %d, %d errors\n",
+           num_requests, num_conns, depth, num_errors);
+    printf("throughput: %.0f requests/s\n", num_requests / (elapsed_ns / 1e9));
+    printf("latency us: mean %.1f  p50 %.1f  p99 %.1f  max %.1f\n",
+           total_ns / 1e3 / num_requests,
+           latencies[num_requests / 2] / 1e3,
+           latencies[(int)(num_requests * 0.99)] / 1e3,
+           latencies[num_requests - 1] / 1e3);
+
+    for (i = 0; i < num_conns; i++) {
+        close(conns[i].fd);
+        free(conns[i].sent_ns);
+        free(conns[i].in);
+    }
+    free(conns);
+    free(fds);
+    free(frames);
+    free(latencies);
+    return 0;
+}
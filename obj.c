@@ -1,56 +1,603 @@
+#define _GNU_SOURCE  // for pthread_getattr_np
 #include "obj.h"
 #include "parse.h"
 #include "symbol.h"
 #include "prim.h"
+#include "vm.h"
+#include "jit.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
-// static object pool
-#define MAX_OBJS 131072 * 4  // 16 meg
-obj_t g_obj_pool[MAX_OBJS];
+//
+// heap
+//
+// The heap is a set of segments mmap'd from the os on demand, each segment
+// is carved up into pages, and every page holds cells of a single obj type.
+// The type of an obj is looked up in the descriptor of the page it lives in,
+// so objs don't need a header, a pair is just its car and cdr.
+//
+// Segments are aligned to their size, so the segment and page descriptor of
+// any obj can be found by masking its address.  The descriptors and the mark
+// bitmap live in the first few pages of the segment, a gc never writes to the
+// pages holding objs.
+//
+// Sweeping is lazy.  A gc only marks, then pages with nothing marked are freed
+// outright and the rest go on the sweep queue, grouped by size class.
+// Allocation sweeps queued pages one at a time when it runs out of free cells.
+// Optionally a background thread sweeps the queue as well, whoever claims a
+// page first sweeps it, and the allocator picks up pages the thread has swept.
+//
+// The collector is generational without moving anything, mark bits are sticky.
+// A minor gc doesn't clear the bitmaps, so marked objs are the old generation
+// and unmarked ones are young.  Marking stops at old objs, and only pages the
+// allocator has handed out cells from since the last gc need sweeping.  Old
+// objs that are written to point at young ones go in the remembered set, its
+// objs are scanned as extra roots by a minor gc.  A major gc clears the
+// bitmaps and starts over.  Fresh pages are bump allocated, so the nursery is
+// mostly pages that emptied out in the last gc.
+//
+// Major gcs can be incremental, see obj_set_gc_pause().  Marking is then
+// spread over slices of bounded length between allocations.  The roots are
+// marked when marking starts, and from then on a write barrier marks the
+// value being overwritten (snapshot at the beginning) and new objs are
+// allocated marked, so nothing reachable at the start can be missed.  Queued
+// pages are not swept while marking, because their marks are being rebuilt.
+//
 
-// free list
-obj_t* g_free_objs = NULL;
-int g_num_free_objs = 0;
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define SEGMENT_SHIFT 20
+#define SEGMENT_SIZE (1 << SEGMENT_SHIFT)  // 1 meg
+#define PAGES_PER_SEGMENT (SEGMENT_SIZE / PAGE_SIZE)
+#define GRANULE_SHIFT 4  // cell sizes are a multiple of 16 bytes
+#define GRANULES_PER_PAGE (PAGE_SIZE >> GRANULE_SHIFT)
+
+// free cells are threaded thru their first word, and have KFREE in their
+// second word.  Live objs never store KFREE so this also catches use after free.
+#define KFREE ((obj_t*)(UNUSED1_TAG | IMM_TAG))
+#define CELL_WORD(obj, i) (((obj_t**)(obj))[i])
+
+typedef struct page_struct {
+    struct page_struct* next;  // next page in the size class or on the free page list.
+    obj_t* free_cells;
+    enum obj_type type;        // GARBAGE_OBJ for unused pages.
+    int size_class;
+    int cell_size;
+    int num_marked;            // sticky, only reset by a major gc.
+    int young;                 // cells were handed out since the last gc.
+    int dirty;                 // free page that has not been handed back to the os.
+    int moving;                // being evacuated by obj_compact().
+    int sweep_state;
+} page_t;
+
+enum page_sweep_state { PAGE_SWEPT = 0, PAGE_UNSWEPT, PAGE_SWEEPING };
+
+typedef struct segment_struct {
+    struct segment_struct* next;
+    page_t* free_pages;  // in address order
+    int num_free_pages;
+    page_t pages[PAGES_PER_SEGMENT];  // the first few describe the header itself.
+    uint64_t mark_bits[PAGES_PER_SEGMENT * GRANULES_PER_PAGE / 64];  // one bit per granule
+    uint64_t remembered_bits[PAGES_PER_SEGMENT * GRANULES_PER_PAGE / 64];  // objs in g_remembered
+} segment_t;
+
+#define SEGMENT_HEADER_PAGES ((int)((sizeof(segment_t) + PAGE_SIZE - 1) / PAGE_SIZE))
+#define SEGMENT_USABLE_PAGES (PAGES_PER_SEGMENT - SEGMENT_HEADER_PAGES)
+
+static segment_t* g_segments = NULL;
+static int g_num_segments = 0;
+static segment_t** g_segment_table = NULL;  // sorted by address, for checking c stack words
+static int g_segment_table_capacity = 0;
+int g_num_free_pages = 0;
+
+// heap sizing, see obj_set_heap_size()
+#define MEG (1024 * 1024)
+static size_t g_heap_initial_size = 4 * MEG;
+static double g_heap_growth_factor = 2.0;
+static size_t g_heap_max_size = 1024 * MEG;
+
+// the heap grows when more then this fraction of it is still in use after a gc.
+#define HEAP_GROW_THRESHOLD 0.5
+
+// each obj type gets its own size class, indexed by type, except frames
+// which get several.  The bigger frame classes go after the types.
+typedef struct {
+    enum obj_type type;
+    int cell_size;
+    char* bump;           // unused part of a fresh page.
+    char* bump_end;
+    page_t* pages;        // swept pages with free cells.
+    page_t* swept_pages;  // handed over by the sweeper thread, guarded by g_sweep_lock.
+    int sweep_cursor;     // next page of this class in g_sweep_queue.
+    int sweep_end;
+} size_class_t;
+
+#define NUM_SIZE_CLASSES (GARBAGE_OBJ + 6)
+
+static size_class_t g_size_classes[NUM_SIZE_CLASSES] = {
+    {SYMBOL_OBJ, 16},
+    {PAIR_OBJ, 16},
+    {ENV_OBJ, 16},
+    {PRIM_FORM_OBJ, 16},
+    {PRIM_PROC_OBJ, 32},
+    {COMP_PROC_OBJ, 32},
+    {CODE_OBJ, 16},
+    {FRAME_OBJ, 32},  // 1 slot
+    {FRAME_OBJ, 48},
+    {FRAME_OBJ, 64},
+    {FRAME_OBJ, 96},
+    {FRAME_OBJ, 128},
+    {FRAME_OBJ, 256},
+    {FRAME_OBJ, 512},  // FRAME_MAX_SLOTS
+};
+
+// a minor gc runs after this many bytes are allocated, see obj_set_nursery_size()
+static size_t g_nursery_size = 1 * MEG;
+static size_t g_nursery_used = 0;
+
+// incremental marking, see obj_set_gc_pause()
+static int g_gc_pause_us = 0;
+static int g_gc_slice_allocs = 1000;
+static int g_gc_marking = 0;
+static size_t g_gc_poll_at = 1 * MEG;  // g_nursery_used that triggers the next gc or slice
+
+// the next gc is a major one, once the old generation has doubled since
+// the last major gc or the heap is filling up.
+static int g_next_gc_major = 0;
+static int g_major_live_pages = 0;
+
+// old objs that may point at young ones.
+static obj_t** g_remembered = NULL;
+static int g_num_remembered = 0;
+static int g_remembered_capacity = 0;
+
+// counters behind obj_get_gc_stats(), and the optional log line per gc.
+static obj_gc_stats_t g_gc_stats;
+static int g_gc_log = 0;
+static int g_gc_pause_depth = 0;  // nested gc entry points make one pause
+static uint64_t g_gc_pause_start = 0;
+static const char* g_gc_finished = NULL;  // kind of gc that finished during this pause
+
+// pages holding marks from the last gc, grouped by size class.
+static page_t** g_sweep_queue = NULL;
+static int g_sweep_queue_size = 0;
+static int g_sweep_queue_capacity = 0;
+
+// background sweeper thread, see obj_set_concurrent_sweep()
+static int g_concurrent_sweep = 0;
+static int g_sweeper_started = 0;
+static pthread_t g_sweeper_thread;
+static pthread_mutex_t g_sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_sweep_cond = PTHREAD_COND_INITIALIZER;
+static int g_sweeper_cursor = 0;
+static int g_sweeper_paused = 1;
+static int g_sweeper_busy = 0;
 
-// used list
-obj_t* g_used_objs = NULL;
 int g_num_used_objs = 0;
 
 // root environment
 obj_t* g_env = KNULL;
+unsigned int g_env_cells_epoch = 1;
+
+// per symbol id, the pair of g_env's plist binding it, so looking a prim up
+// doesn't scan them all.  The plist is what the gc sees, the pairs are
+// rebuilt from it after anything that moves them.  Also what a define in
+// another env needs to know to keep the caches of obj_env_cache_cell() good.
+typedef struct {
+    obj_t* pair;            // NULL if g_env doesn't bind the symbol
+    unsigned int cached;    // g_env_cells_epoch when a cache last took a cell for it
+    int in_frame_plist;     // it's been defined into a frame's plist, so it's never cached
+} global_cell_t;
+
+static global_cell_t* g_global_cells = NULL;
+static int g_global_cells_capacity = 0;
+
+static uint64_t g_comp_proc_serial = 0;
+
+// c stack depth at which evaluation fails with an error instead of running
+// off the end of the stack, see _c_stack_init().
+static size_t g_c_stack_limit = 0;
 
-// root stack
-#define MAX_STACK_OBJS 100000
-#define MAX_STACK_FRAMES 10000
-obj_t* g_stack[MAX_STACK_OBJS];
-int g_num_stack_objs;
-int g_stack_frames[MAX_STACK_FRAMES];
-int g_num_stack_frames;
+// innermost error handler, see obj_error().
+static obj_handler_t* g_handler = NULL;
+static char g_error_message[256] = "";
 
-int g_mark = 0;
+// interned symbol objs, indexed by symbol id.  These are gc roots.
+obj_t** g_symbol_objs = NULL;
+int g_symbol_objs_capacity = 0;
 
 static obj_t* _assq(obj_t* key, obj_t* plist);
+static int _frame_index(obj_t* frame, obj_t* symbol);
+static obj_t* _global_cell(obj_t* symbol);
+static global_cell_t* _global_cell_info(obj_t* symbol);
+static void _global_cells_rebuild();
+static int _gc_collect(int major);
+static void _gc_poll();
+static int _gc_test_and_set_mark(obj_t* obj);
+static void _fork_init();
+
+static segment_t* _segment_of(void* p)
+{
+    return (segment_t*)((uintptr_t)p & ~(uintptr_t)(SEGMENT_SIZE - 1));
+}
 
-//
-// obj pool
-//
+static page_t* _page_of(obj_t* obj)
+{
+    return _segment_of(obj)->pages + (((uintptr_t)obj & (SEGMENT_SIZE - 1)) >> PAGE_SHIFT);
+}
+
+static char* _page_start(page_t* page)
+{
+    segment_t* segment = _segment_of(page);
+    return (char*)segment + ((page - segment->pages) << PAGE_SHIFT);
+}
+
+// rebuilds the segment's free page list in address order.
+static void _segment_link_free_pages(segment_t* segment)
+{
+    int i;
+    segment->free_pages = NULL;
+    segment->num_free_pages = 0;
+    for (i = PAGES_PER_SEGMENT - 1; i >= SEGMENT_HEADER_PAGES; i--) {
+        page_t* page = segment->pages + i;
+        if (page->type == GARBAGE_OBJ) {
+            page->next = segment->free_pages;
+            segment->free_pages = page;
+            segment->num_free_pages++;
+        }
+    }
+}
 
-static void _pool_init()
+static void _segment_table_insert(segment_t* segment)
 {
-    // init obj pool
+    if (g_num_segments == g_segment_table_capacity) {
+        g_segment_table_capacity = g_segment_table_capacity ? g_segment_table_capacity * 2 : 64;
+        g_segment_table = (segment_t**)realloc(g_segment_table, sizeof(segment_t*) * g_segment_table_capacity);
+        assert(g_segment_table);
+    }
+    int i = g_num_segments;
+    while (i > 0 && g_segment_table[i - 1] > segment) {
+        g_segment_table[i] = g_segment_table[i - 1];
+        i--;
+    }
+    g_segment_table[i] = segment;
+}
+
+static void _segment_table_remove(segment_t* segment)
+{
+    int i = 0;
+    while (g_segment_table[i] != segment)
+        i++;
+    memmove(g_segment_table + i, g_segment_table + i + 1, sizeof(segment_t*) * (g_num_segments - i - 1));
+}
+
+static int _segment_table_find(segment_t* segment)
+{
+    int lo = 0, hi = g_num_segments - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (g_segment_table[mid] == segment)
+            return 1;
+        else if (g_segment_table[mid] < segment)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return 0;
+}
+
+static segment_t* _segment_alloc()
+{
+    // over allocate, so the segment can be aligned to its size.
+    char* p = (char*)mmap(NULL, 2 * SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    char* start = (char*)(((uintptr_t)p + SEGMENT_SIZE - 1) & ~(uintptr_t)(SEGMENT_SIZE - 1));
+    if (start > p)
+        munmap(p, start - p);
+    if (start + SEGMENT_SIZE < p + 2 * SEGMENT_SIZE)
+        munmap(start + SEGMENT_SIZE, p + 2 * SEGMENT_SIZE - (start + SEGMENT_SIZE));
+
+    // fresh mappings are zero filled, so only the page types need setting.
+    segment_t* segment = (segment_t*)start;
     int i;
-    for (i = 0; i < MAX_OBJS - 1; i++)
-        g_obj_pool[i].next = g_obj_pool + i + 1;
-    g_free_objs = g_obj_pool;
-    g_num_free_objs = MAX_OBJS;
+    for (i = 0; i < PAGES_PER_SEGMENT; i++)
+        segment->pages[i].type = GARBAGE_OBJ;
+    _segment_link_free_pages(segment);
+
+    segment->next = g_segments;
+    g_segments = segment;
+    _segment_table_insert(segment);
+    g_num_segments++;
+    g_num_free_pages += segment->num_free_pages;
+    return segment;
+}
+
+static size_t _heap_size()
+{
+    return (size_t)g_num_segments * SEGMENT_SIZE;
+}
+
+// adds segments until the heap is at least size bytes, or the max size is hit.
+static int _heap_grow(size_t size)
+{
+    if (size > g_heap_max_size)
+        size = g_heap_max_size;
+    int grew = 0;
+    while (_heap_size() < size && _segment_alloc())
+        grew = 1;
+    return grew;
+}
+
+static void _heap_init()
+{
     g_num_used_objs = 0;
+    _heap_grow(g_heap_initial_size > SEGMENT_SIZE ? g_heap_initial_size : SEGMENT_SIZE);
+}
+
+void obj_set_heap_size(size_t initial_size, double growth_factor, size_t max_size)
+{
+    assert(!g_segments);  // must be called before obj_init
+    if (initial_size)
+        g_heap_initial_size = initial_size;
+    if (growth_factor)
+        g_heap_growth_factor = growth_factor;
+    if (max_size)
+        g_heap_max_size = max_size;
+    assert(g_heap_growth_factor > 1.0);
+    assert(g_heap_initial_size <= g_heap_max_size);
+}
+
+void obj_set_nursery_size(size_t size)
+{
+    assert(size > 0);
+    g_nursery_size = size;
+    if (!g_gc_marking)
+        g_gc_poll_at = size;
+}
+
+void obj_set_gc_pause(int max_pause_us, int slice_allocs)
+{
+    assert(max_pause_us >= 0 && slice_allocs > 0);
+    g_gc_pause_us = max_pause_us;
+    g_gc_slice_allocs = slice_allocs;
+}
+
+static void _page_free_cell(page_t* page, obj_t* obj)
+{
+    CELL_WORD(obj, 0) = page->free_cells;
+    CELL_WORD(obj, 1) = KFREE;
+    page->free_cells = obj;
+}
+
+// a code obj owns its bytecode, which goes when the cell does.  Code pages
+// are zeroed when they're handed out, so cells that were never allocated
+// have no bytecode.
+static void _cell_finalize(page_t* page, obj_t* obj)
+{
+    if (page->type == CODE_OBJ && CELL_WORD(obj, 1) != KFREE && obj->data.code.bytecode) {
+        jit_free(obj->data.code.bytecode->jit);
+        free(obj->data.code.bytecode);
+        obj->data.code.bytecode = NULL;
+    }
+}
+
+// for a page that's freed without being swept.
+static void _page_finalize(page_t* page)
+{
+    char* start = _page_start(page);
+    char* p;
+    if (page->type != CODE_OBJ)
+        return;
+    for (p = start; p + page->cell_size <= start + PAGE_SIZE; p += page->cell_size)
+        _cell_finalize(page, (obj_t*)p);
+}
+
+// takes a free page and makes it the bump allocation region of its size class.
+static page_t* _page_alloc(int size_class_index)
+{
+    segment_t* segment = g_segments;
+    while (segment && !segment->free_pages)
+        segment = segment->next;
+    if (!segment)
+        return NULL;
+    page_t* page = segment->free_pages;
+    segment->free_pages = page->next;
+    segment->num_free_pages--;
+    g_num_free_pages--;
+
+    size_class_t* size_class = g_size_classes + size_class_index;
+    page->type = size_class->type;
+    page->size_class = size_class_index;
+    page->cell_size = size_class->cell_size;
+    page->num_marked = 0;
+    page->young = 1;
+    page->dirty = 0;
+    page->moving = 0;
+    page->sweep_state = PAGE_SWEPT;
+    page->free_cells = NULL;
+    if (page->type == CODE_OBJ)
+        memset(_page_start(page), 0, PAGE_SIZE);
+
+    size_class->bump = _page_start(page);
+    size_class->bump_end = size_class->bump + (PAGE_SIZE / page->cell_size) * page->cell_size;
+    return page;
+}
+
+static int _mark_index(obj_t* obj)
+{
+    return ((uintptr_t)obj & (SEGMENT_SIZE - 1)) >> GRANULE_SHIFT;
+}
+
+static int _is_marked(obj_t* obj)
+{
+    int i = _mark_index(obj);
+    return (_segment_of(obj)->mark_bits[i >> 6] >> (i & 63)) & 1;
+}
+
+// frees every unmarked cell in the page.  Marks are left alone, they are what
+// makes the live cells old.  This can run on the sweeper thread while the
+// mutator is using live cells in the same page, so only unmarked cells are touched.
+static void _page_sweep(page_t* page)
+{
+    char* start = _page_start(page);
+    char* end = start + (PAGE_SIZE / page->cell_size) * page->cell_size;
+    char* p;
+
+    // rebuild the free list in address order.
+    page->free_cells = NULL;
+    for (p = end - page->cell_size; p >= start; p -= page->cell_size) {
+        obj_t* obj = (obj_t*)p;
+        if (!_is_marked(obj)) {
+#ifdef GC_DEBUG
+            if (CELL_WORD(obj, 1) != KFREE) {
+                fprintf(stderr, "FREE obj %p, ", obj);
+                obj_dump(obj, 1);
+                fprintf(stderr, "\n");
+            }
+#endif
+            _cell_finalize(page, obj);
+            _page_free_cell(page, obj);
+        }
+    }
+}
+
+// sweeps the page unless the other thread has already claimed it.
+static int _page_try_sweep(page_t* page)
+{
+    int state = PAGE_UNSWEPT;
+    if (!__atomic_compare_exchange_n(&page->sweep_state, &state, PAGE_SWEEPING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    _page_sweep(page);
+    __atomic_store_n(&page->sweep_state, PAGE_SWEPT, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// finds a page with free cells, either one the sweeper thread has finished
+// or by sweeping queued pages of the size class.
+static page_t* _size_class_sweep(size_class_t* size_class)
+{
+    if (g_concurrent_sweep && __atomic_load_n(&size_class->swept_pages, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&g_sweep_lock);
+        while (size_class->swept_pages) {
+            page_t* page = size_class->swept_pages;
+            size_class->swept_pages = page->next;
+            page->next = size_class->pages;
+            size_class->pages = page;
+        }
+        pthread_mutex_unlock(&g_sweep_lock);
+        return size_class->pages;
+    }
+
+    while (!g_gc_marking && size_class->sweep_cursor < size_class->sweep_end) {
+        page_t* page = g_sweep_queue[size_class->sweep_cursor++];
+        if (_page_try_sweep(page) && page->free_cells) {
+            page->next = size_class->pages;
+            size_class->pages = page;
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static void* _sweeper_main(void* arg)
+{
+    pthread_mutex_lock(&g_sweep_lock);
+    while (1) {
+        while (g_sweeper_paused || g_sweeper_cursor >= g_sweep_queue_size)
+            pthread_cond_wait(&g_sweep_cond, &g_sweep_lock);
+        page_t* page = g_sweep_queue[g_sweeper_cursor++];
+        g_sweeper_busy = 1;
+        pthread_mutex_unlock(&g_sweep_lock);
+
+        int swept = _page_try_sweep(page);
+
+        pthread_mutex_lock(&g_sweep_lock);
+        if (swept && page->free_cells) {
+            size_class_t* size_class = g_size_classes + page->size_class;
+            page->next = size_class->swept_pages;
+            __atomic_store_n(&size_class->swept_pages, page, __ATOMIC_RELAXED);
+        }
+        g_sweeper_busy = 0;
+        pthread_cond_broadcast(&g_sweep_cond);
+    }
+    return NULL;
+}
+
+// stops the sweeper thread from picking up pages, and waits for the page it's on.
+static void _sweeper_pause()
+{
+    if (!g_sweeper_started)
+        return;
+    pthread_mutex_lock(&g_sweep_lock);
+    g_sweeper_paused = 1;
+    while (g_sweeper_busy)
+        pthread_cond_wait(&g_sweep_cond, &g_sweep_lock);
+    pthread_mutex_unlock(&g_sweep_lock);
 }
 
-static obj_t* _pool_alloc()
+// starts the sweeper thread on a freshly built sweep queue.
+static void _sweeper_resume()
+{
+    if (!g_concurrent_sweep)
+        return;
+    if (!g_sweeper_started) {
+        if (pthread_create(&g_sweeper_thread, NULL, _sweeper_main, NULL) != 0) {
+            g_concurrent_sweep = 0;  // the allocator will do all the sweeping
+            return;
+        }
+        g_sweeper_started = 1;
+    }
+    pthread_mutex_lock(&g_sweep_lock);
+    g_sweeper_cursor = 0;
+    g_sweeper_paused = 0;
+    pthread_cond_broadcast(&g_sweep_cond);
+    pthread_mutex_unlock(&g_sweep_lock);
+}
+
+void obj_set_concurrent_sweep(int enabled)
+{
+    if (!enabled)
+        _sweeper_pause();
+    g_concurrent_sweep = enabled;
+}
+
+// gives the size class a bump region or a page with free cells.
+static int _size_class_take(size_class_t* size_class)
+{
+    return _size_class_sweep(size_class) || _page_alloc(size_class - g_size_classes);
+}
+
+// collects, and grows the heap as a last resort, until the size class has cells.
+static void _size_class_refill(size_class_t* size_class)
+{
+    if (_size_class_take(size_class))
+        return;
+    int major = _gc_collect(0);
+    if (_size_class_take(size_class))
+        return;
+    if (!major) {
+        _gc_collect(1);
+        if (_size_class_take(size_class))
+            return;
+    }
+    if (_heap_grow((size_t)(_heap_size() * g_heap_growth_factor)) && _size_class_take(size_class))
+        return;
+    fprintf(stderr, "ERROR: out of memory, heap is %zu bytes\n", _heap_size());
+    abort();
+}
+
+static obj_t* _heap_alloc_class(int size_class_index)
 {
     // TODO: REMOVE
     // Really hammer on gc...
@@ -61,236 +608,989 @@ static obj_t* _pool_alloc()
     count++;
     */
 
-    if (!g_free_objs)
-        obj_gc();
+    if (g_nursery_used >= g_gc_poll_at)
+        _gc_poll();
 
-    // take from front of free list
-    assert(g_free_objs);
-    obj_t* obj = g_free_objs;
-    g_free_objs = g_free_objs->next;
-    if (g_free_objs)
-        g_free_objs->prev = NULL;
-    g_num_free_objs--;
-
-    // add to front of used list
-    obj->prev = NULL;
-    obj->next = g_used_objs;
-    if (g_used_objs)
-        g_used_objs->prev = obj;
-    g_used_objs = obj;
-    g_num_used_objs++;
+    size_class_t* size_class = g_size_classes + size_class_index;
+    if (size_class->bump == size_class->bump_end && !size_class->pages)
+        _size_class_refill(size_class);
 
-    assert(g_num_used_objs + g_num_free_objs == MAX_OBJS);
+    obj_t* obj;
+    if (size_class->bump < size_class->bump_end) {
+        obj = (obj_t*)size_class->bump;
+        size_class->bump += size_class->cell_size;
+    } else {
+        // take from front of the page's free list
+        page_t* page = size_class->pages;
+        obj = page->free_cells;
+        assert(CELL_WORD(obj, 1) == KFREE);
+        page->free_cells = CELL_WORD(obj, 0);
+        if (!page->free_cells)
+            size_class->pages = page->next;  // page is full
+        page->young = 1;
+    }
+    g_nursery_used += size_class->cell_size;
+    g_num_used_objs++;
+    g_gc_stats.objs_allocated[size_class->type]++;
+    g_gc_stats.bytes_allocated[size_class->type] += size_class->cell_size;
 
-    obj->mark = 0;
+    CELL_WORD(obj, 1) = NULL;
+    if (g_gc_marking)
+        _gc_test_and_set_mark(obj);  // allocate black
     return obj;
 }
 
-static void _pool_free(obj_t* obj)
+static obj_t* _heap_alloc(enum obj_type type)
 {
-#ifdef GC_DEBUG
-    fprintf(stderr, "FREE obj %p, ", obj);
-    obj_dump(obj, 1);
-    fprintf(stderr, "\n");
-#endif
+    assert(type != FRAME_OBJ);
+    return _heap_alloc_class(type);
+}
 
-    assert(obj);
+enum obj_type obj_get_type(obj_t* obj)
+{
+    assert(!obj_is_immediate(obj));
+    return _page_of(obj)->type;
+}
 
-    // remove from used list
-    if (obj->prev)
-        obj->prev->next = obj->next;
-    else
-        g_used_objs = obj->next;
-    if (obj->next)
-        obj->next->prev = obj->prev;
-    g_num_used_objs--;
+//
+// parallel mark
+//
+// Each gc thread has a private mark stack and a shared one that other threads
+// can steal from.  A thread with a deep private stack hands half of it over to
+// its shared stack whenever that runs dry.  Marking is done when every thread
+// is idle, which can only happen once all the shared stacks are empty.
+//
 
-    // add to start of free list
-    obj->next = g_free_objs;
-    if (g_free_objs)
-        g_free_objs->prev = obj;
-    g_free_objs = obj;
-    g_num_free_objs++;
+#define MAX_GC_THREADS 64
+#define MARK_STACK_PUBLISH_SIZE 64
+
+typedef struct {
+    obj_t** objs;
+    int size;
+    int capacity;
+} mark_stack_t;
+
+typedef struct {
+    mark_stack_t local;
+    mark_stack_t shared;
+    pthread_mutex_t shared_lock;
+    pthread_t thread;
+    int index;
+    int epoch;  // the gc before the one the worker was started for
+} mark_worker_t;
+
+static int g_num_gc_threads = 1;
+static mark_worker_t g_mark_workers[MAX_GC_THREADS];
+static int g_num_mark_workers_started = 0;  // not counting the mutator thread
+static int g_mark_idle;
+
+// mark workers sleep on g_mark_start_cond between collections.
+static pthread_mutex_t g_mark_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_mark_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_mark_done_cond = PTHREAD_COND_INITIALIZER;
+static int g_mark_epoch = 0;
+static int g_mark_num_done = 0;
+
+void obj_set_gc_threads(int num_threads)
+{
+    assert(num_threads >= 1 && num_threads <= MAX_GC_THREADS);
+    // threads that are already running stay parked if the count goes down.
+    g_num_gc_threads = num_threads;
+}
 
-    // helps track down gc problems.
-    obj->type = GARBAGE_OBJ;
+static void _mark_stack_reserve(mark_stack_t* stack, int size)
+{
+    if (size > stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity : 1024;
+        while (stack->capacity < size)
+            stack->capacity *= 2;
+        stack->objs = (obj_t**)realloc(stack->objs, sizeof(obj_t*) * stack->capacity);
+        assert(stack->objs);
+    }
+}
 
-    assert(g_num_used_objs + g_num_free_objs == MAX_OBJS);
+static void _mark_stack_push(mark_stack_t* stack, obj_t* obj)
+{
+    _mark_stack_reserve(stack, stack->size + 1);
+    stack->objs[stack->size++] = obj;
 }
 
-#ifdef GC_DEBUG
-static void _dump_list(const char* desc, obj_t* obj)
+// only the first thread to set an obj's mark bit pushes it.
+static int _gc_test_and_set_mark(obj_t* obj)
+{
+    segment_t* segment = _segment_of(obj);
+    int i = _mark_index(obj);
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    if (__atomic_load_n(segment->mark_bits + (i >> 6), __ATOMIC_RELAXED) & bit)
+        return 1;
+    if (__atomic_fetch_or(segment->mark_bits + (i >> 6), bit, __ATOMIC_RELAXED) & bit)
+        return 1;
+    __atomic_fetch_add(&_page_of(obj)->num_marked, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void _gc_mark(mark_worker_t* worker, obj_t* obj)
 {
-    fprintf(stderr, "%s = [\n", desc);
-    obj_t* p = obj;
-    while (p) {
-        fprintf(stderr, "    <%p prev = %p, next = %p>\n", p, p->prev, p->next);
-        p = p->next;
+    if (!obj_is_immediate(obj)) {
+        assert(!obj_is_garbage(obj));
+        if (!_gc_test_and_set_mark(obj))
+            _mark_stack_push(&worker->local, obj);
     }
-    fprintf(stderr, "]\n");
 }
-#endif
+
+// every slot the frame's cell has room for, the ones past what its code
+// uses are ().
+static int _frame_num_slots(obj_t* frame)
+{
+    return (_page_of(frame)->cell_size - (int)sizeof(frame_t)) / (int)sizeof(obj_t*);
+}
+
+static void _gc_scan(mark_worker_t* worker, obj_t* obj)
+{
+    switch (obj_get_type(obj)) {
+    case SYMBOL_OBJ:
+    case PRIM_FORM_OBJ:
+    case PRIM_PROC_OBJ:
+        // These objs don't reference anything.
+        break;
+    case PAIR_OBJ:
+        _gc_mark(worker, obj->data.pair.car);
+        _gc_mark(worker, obj->data.pair.cdr);
+        break;
+    case ENV_OBJ:
+        _gc_mark(worker, obj->data.env.plist);
+        _gc_mark(worker, obj->data.env.parent);
+        break;
+    case FRAME_OBJ:
+    {
+        int i, n = _frame_num_slots(obj);
+        _gc_mark(worker, obj->data.frame.plist);
+        _gc_mark(worker, obj->data.frame.parent);
+        _gc_mark(worker, obj->data.frame.names);
+        for (i = 0; i < n; i++)
+            _gc_mark(worker, obj->data.frame.slots[i]);
+        break;
+    }
+    case COMP_PROC_OBJ:
+        _gc_mark(worker, obj->data.comp_proc.formals);
+        _gc_mark(worker, obj->data.comp_proc.env);
+        _gc_mark(worker, obj->data.comp_proc.body);
+        break;
+    case CODE_OBJ:
+    {
+        bytecode_t* bytecode = obj->data.code.bytecode;
+        int i;
+        _gc_mark(worker, obj->data.code.source);
+        for (i = 0; i < bytecode->num_consts; i++)
+            _gc_mark(worker, bytecode->consts[i]);
+        break;
+    }
+    default:
+        assert(0);  // bad obj type!
+        break;
+    }
+}
+
+// moves the bottom half of the private stack to the shared stack.
+// the shared stack size is read without the lock, so it is always stored atomically.
+static void _mark_publish(mark_worker_t* worker)
+{
+    mark_stack_t* local = &worker->local;
+    mark_stack_t* shared = &worker->shared;
+    int n = local->size / 2;
+    pthread_mutex_lock(&worker->shared_lock);
+    _mark_stack_reserve(shared, shared->size + n);
+    memcpy(shared->objs + shared->size, local->objs, sizeof(obj_t*) * n);
+    __atomic_store_n(&shared->size, shared->size + n, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->shared_lock);
+    memmove(local->objs, local->objs + n, sizeof(obj_t*) * (local->size - n));
+    local->size -= n;
+}
+
+// takes half of some thread's shared stack.
+static int _mark_steal(mark_worker_t* worker, int num_threads)
+{
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        mark_worker_t* victim = g_mark_workers + (worker->index + i) % num_threads;
+        mark_stack_t* shared = &victim->shared;
+        if (!__atomic_load_n(&shared->size, __ATOMIC_RELAXED))
+            continue;
+        pthread_mutex_lock(&victim->shared_lock);
+        int n = (shared->size + 1) / 2;
+        _mark_stack_reserve(&worker->local, worker->local.size + n);
+        memcpy(worker->local.objs + worker->local.size, shared->objs + shared->size - n, sizeof(obj_t*) * n);
+        worker->local.size += n;
+        __atomic_store_n(&shared->size, shared->size - n, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&victim->shared_lock);
+        if (n)
+            return 1;
+    }
+    return 0;
+}
+
+static int _mark_any_shared(int num_threads)
+{
+    int i;
+    for (i = 0; i < num_threads; i++)
+        if (__atomic_load_n(&g_mark_workers[i].shared.size, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+static void _mark_drain(mark_worker_t* worker, int num_threads)
+{
+    while (1) {
+        while (worker->local.size) {
+            if (num_threads > 1 && worker->local.size > MARK_STACK_PUBLISH_SIZE &&
+                !__atomic_load_n(&worker->shared.size, __ATOMIC_RELAXED))
+                _mark_publish(worker);
+            _gc_scan(worker, worker->local.objs[--worker->local.size]);
+        }
+
+        if (num_threads == 1)
+            return;
+        if (_mark_steal(worker, num_threads))
+            continue;
+
+        // nothing left anywhere we can see, wait for work or for everyone to finish.
+        if (__atomic_add_fetch(&g_mark_idle, 1, __ATOMIC_SEQ_CST) == num_threads)
+            return;
+        while (1) {
+            if (__atomic_load_n(&g_mark_idle, __ATOMIC_SEQ_CST) == num_threads)
+                return;
+            if (_mark_any_shared(num_threads)) {
+                __atomic_sub_fetch(&g_mark_idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* _mark_worker_main(void* arg)
+{
+    mark_worker_t* worker = (mark_worker_t*)arg;
+    int epoch = worker->epoch;
+    while (1) {
+        pthread_mutex_lock(&g_mark_lock);
+        while (g_mark_epoch == epoch || worker->index >= g_num_gc_threads)
+            pthread_cond_wait(&g_mark_start_cond, &g_mark_lock);
+        epoch = g_mark_epoch;
+        pthread_mutex_unlock(&g_mark_lock);
+
+        _mark_drain(worker, g_num_gc_threads);
+
+        pthread_mutex_lock(&g_mark_lock);
+        g_mark_num_done++;
+        pthread_cond_signal(&g_mark_done_cond);
+        pthread_mutex_unlock(&g_mark_lock);
+    }
+    return NULL;
+}
+
+static void _mark_init()
+{
+    int i;
+    for (i = 0; i < MAX_GC_THREADS; i++) {
+        g_mark_workers[i].index = i;
+        pthread_mutex_init(&g_mark_workers[i].shared_lock, NULL);
+    }
+}
+
+//
+// c stack roots
+//
+// C code doesn't register the objs it's holding on to.  Instead each gc scans
+// the C stack of the mutator thread, from the top down to the base recorded by
+// obj_init(), and treats every word that points into a handed out cell as a
+// root.  The callee saved registers are spilled onto the stack first.  Being
+// conservative this can keep some garbage alive, and objs found this way are
+// pinned, obj_compact() won't move them.
+//
+// A word points at a live obj if its page is swept and the cell isn't free or
+// past the bump pointer, or if its page is still waiting to be swept and the
+// cell was marked by the last gc.  This has to be decided before a major gc
+// clears the marks.
+//
+
+#define C_STACK_RESERVE (256 * 1024)
+
+static char* g_c_stack_base = NULL;
+static obj_t** g_c_roots = NULL;
+static int g_num_c_roots = 0;
+static int g_c_roots_capacity = 0;
+
+static void _c_stack_init()
+{
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    int ok = pthread_getattr_np(pthread_self(), &attr) == 0;
+    assert(ok);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    g_c_stack_base = (char*)addr + size;
+
+    // leave room for the frames between the last check and a gc or an error
+    // report, printf alone can take a few k.
+    g_c_stack_limit = size > 2 * C_STACK_RESERVE ? size - C_STACK_RESERVE : size / 2;
+}
+
+// returns the obj the word points into, or NULL.
+static obj_t* _c_root_obj(uintptr_t word)
+{
+    segment_t* segment = _segment_of((void*)word);
+    if (word < (uintptr_t)g_segment_table[0] || !_segment_table_find(segment))
+        return NULL;
+    int index = (word & (SEGMENT_SIZE - 1)) >> PAGE_SHIFT;
+    page_t* page = segment->pages + index;
+    if (index < SEGMENT_HEADER_PAGES || page->type == GARBAGE_OBJ)
+        return NULL;
+
+    char* start = _page_start(page);
+    int cell = (int)((char*)word - start) / page->cell_size;
+    if (cell >= PAGE_SIZE / page->cell_size)
+        return NULL;
+    obj_t* obj = (obj_t*)(start + cell * page->cell_size);
+
+    size_class_t* size_class = g_size_classes + page->size_class;
+    if ((char*)obj >= size_class->bump && (char*)obj < size_class->bump_end)
+        return NULL;
+    if (page->sweep_state != PAGE_SWEPT)
+        return _is_marked(obj) ? obj : NULL;
+    return CELL_WORD(obj, 1) == KFREE ? NULL : obj;
+}
+
+static void __attribute__((noinline)) _c_stack_scan()
+{
+    char* p = (char*)((uintptr_t)__builtin_frame_address(0) & ~(uintptr_t)(sizeof(void*) - 1));
+    for (; p < g_c_stack_base; p += sizeof(void*)) {
+        obj_t* obj = _c_root_obj(*(uintptr_t*)p);
+        if (obj) {
+            if (g_num_c_roots == g_c_roots_capacity) {
+                g_c_roots_capacity = g_c_roots_capacity ? g_c_roots_capacity * 2 : 1024;
+                g_c_roots = (obj_t**)realloc(g_c_roots, sizeof(obj_t*) * g_c_roots_capacity);
+                assert(g_c_roots);
+            }
+            g_c_roots[g_num_c_roots++] = obj;
+        }
+    }
+}
+
+// collects the objs referenced from the c stack and registers into g_c_roots.
+static void __attribute__((noinline)) _c_stack_find_roots()
+{
+    __builtin_unwind_init();  // spills the callee saved registers into this frame
+    g_num_c_roots = 0;
+    _c_stack_scan();
+    __asm__ volatile ("" ::: "memory");  // keeps the call above from becoming a tail call, which pops the spills
+}
+
+static void _mark_roots(mark_worker_t* worker, int major)
+{
+    assert(obj_is_environment(g_env));
+    _gc_mark(worker, g_env);
+
+    int i;
+    obj_t** p;
+    for (p = g_vm_stack; p < g_vm_sp; ++p)
+        _gc_mark(worker, *p);
+
+    for (i = 0; i < g_num_c_roots; ++i)
+        _gc_mark(worker, g_c_roots[i]);
+
+    for (i = 0; i < g_symbol_objs_capacity; ++i)
+        if (g_symbol_objs[i])
+            _gc_mark(worker, g_symbol_objs[i]);
+
+    // old objs are already marked, so a minor gc scans what they point at instead.
+    if (!major)
+        for (i = 0; i < g_num_remembered; ++i)
+            _gc_scan(worker, g_remembered[i]);
+}
+
+// marks everything reachable from the objs on the mark stack, the calling
+// thread acts as worker 0.
+static void _gc_mark_all()
+{
+    int num_threads = g_num_gc_threads;
+    mark_worker_t* worker = g_mark_workers;
+    if (num_threads == 1) {
+        _mark_drain(worker, 1);
+        return;
+    }
+
+    while (g_num_mark_workers_started < num_threads - 1) {
+        mark_worker_t* w = g_mark_workers + 1 + g_num_mark_workers_started;
+        w->epoch = g_mark_epoch;
+        if (pthread_create(&w->thread, NULL, _mark_worker_main, w) != 0)
+            break;
+        g_num_mark_workers_started++;
+    }
+    if (g_num_mark_workers_started < num_threads - 1)
+        num_threads = g_num_mark_workers_started + 1;  // couldn't start them all
+
+    g_mark_idle = 0;
+    _mark_publish(worker);
+    pthread_mutex_lock(&g_mark_lock);
+    g_num_gc_threads = num_threads;
+    g_mark_num_done = 0;
+    g_mark_epoch++;
+    pthread_cond_broadcast(&g_mark_start_cond);
+    pthread_mutex_unlock(&g_mark_lock);
+
+    _mark_drain(worker, num_threads);
+
+    pthread_mutex_lock(&g_mark_lock);
+    while (g_mark_num_done < num_threads - 1)
+        pthread_cond_wait(&g_mark_done_cond, &g_mark_lock);
+    pthread_mutex_unlock(&g_mark_lock);
+}
 
 //
 // gc
 //
 
-#ifndef NDEBUG
-static int _pool_num_used()
+// hands free memory back to the os.  Empty segments above the initial heap
+// size are unmapped, and free pages in the rest are madvise'd away.
+static void _heap_release()
 {
-    int num_used = 0;
-    obj_t* used_objs = g_used_objs;
-    while (used_objs) {
-        num_used++;
-        used_objs = used_objs->next;
+    size_t used_size = _heap_size() - (size_t)g_num_free_pages * PAGE_SIZE;
+    segment_t** link = &g_segments;
+    while (*link) {
+        segment_t* segment = *link;
+        if (segment->num_free_pages == SEGMENT_USABLE_PAGES &&
+            _heap_size() - SEGMENT_SIZE >= g_heap_initial_size &&
+            (_heap_size() - SEGMENT_SIZE) * HEAP_GROW_THRESHOLD >= used_size) {
+            *link = segment->next;
+            _segment_table_remove(segment);
+            g_num_segments--;
+            g_num_free_pages -= segment->num_free_pages;
+            munmap(segment, SEGMENT_SIZE);
+            continue;
+        }
+
+        // madvise runs of dirty free pages.
+        int i = SEGMENT_HEADER_PAGES;
+        while (i < PAGES_PER_SEGMENT) {
+            if (segment->pages[i].type != GARBAGE_OBJ || !segment->pages[i].dirty) {
+                i++;
+                continue;
+            }
+            int start = i;
+            while (i < PAGES_PER_SEGMENT && segment->pages[i].type == GARBAGE_OBJ && segment->pages[i].dirty)
+                segment->pages[i++].dirty = 0;
+            madvise((char*)segment + ((size_t)start << PAGE_SHIFT), (size_t)(i - start) << PAGE_SHIFT, MADV_DONTNEED);
+        }
+
+        link = &segment->next;
     }
-    assert(g_num_used_objs == num_used);
-    return num_used;
 }
-#endif
 
-static void _gc_mark(obj_t* obj)
+// remembers an old obj that is about to point at a young one.
+static void _remember(obj_t* obj)
 {
-    if (!obj_is_immediate(obj)) {
+    segment_t* segment = _segment_of(obj);
+    int i = _mark_index(obj);
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    if (segment->remembered_bits[i >> 6] & bit)
+        return;
+    segment->remembered_bits[i >> 6] |= bit;
+    if (g_num_remembered == g_remembered_capacity) {
+        g_remembered_capacity = g_remembered_capacity ? g_remembered_capacity * 2 : 1024;
+        g_remembered = (obj_t**)realloc(g_remembered, sizeof(obj_t*) * g_remembered_capacity);
+        assert(g_remembered);
+    }
+    g_remembered[g_num_remembered++] = obj;
+}
 
-        if (obj->mark == g_mark)
-            return;
+// must be called whenever a field of an existing obj is changed from old_value to value.
+static void _write_barrier(obj_t* obj, obj_t* old_value, obj_t* value)
+{
+    if (g_gc_marking) {
+        _gc_mark(g_mark_workers, old_value);
+        return;
+    }
+    if (!obj_is_immediate(value) && _is_marked(obj) && !_is_marked(value))
+        _remember(obj);
+}
+
+// after a gc every live obj is old, so nothing needs remembering.
+static void _forget_all()
+{
+    int i;
+    for (i = 0; i < g_num_remembered; i++) {
+        obj_t* obj = g_remembered[i];
+        int j = _mark_index(obj);
+        _segment_of(obj)->remembered_bits[j >> 6] &= ~((uint64_t)1 << (j & 63));
+    }
+    g_num_remembered = 0;
+}
+
+// a major gc forgets which objs are old.
+static void _gc_clear_marks()
+{
+    segment_t* segment;
+    int i;
+    for (segment = g_segments; segment; segment = segment->next) {
+        memset(segment->mark_bits, 0, sizeof(segment->mark_bits));
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++)
+            segment->pages[i].num_marked = 0;
+    }
+}
+
+// after marking, frees the pages with nothing marked and queues the rest up
+// for sweeping.
+static void _gc_finish(int major)
+{
+    _forget_all();
+    g_gc_marking = 0;
+
+    // pages with nothing marked are freed right away.  Pages that were
+    // allocated from, or never got swept after the last gc, are queued up to
+    // be swept, the rest keep their free lists.
+    segment_t* segment;
+    int i;
+    int total_pages = g_num_segments * PAGES_PER_SEGMENT;
+    if (g_sweep_queue_capacity < total_pages) {
+        g_sweep_queue_capacity = total_pages;
+        g_sweep_queue = (page_t**)realloc(g_sweep_queue, sizeof(page_t*) * total_pages);
+        assert(g_sweep_queue);
+    }
+    for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+        g_size_classes[i].bump = NULL;
+        g_size_classes[i].bump_end = NULL;
+        g_size_classes[i].pages = NULL;
+        g_size_classes[i].swept_pages = NULL;
+        g_size_classes[i].sweep_end = 0;
+    }
+    g_num_used_objs = 0;
+    g_num_free_pages = 0;
+    for (segment = g_segments; segment; segment = segment->next) {
+        for (i = PAGES_PER_SEGMENT - 1; i >= SEGMENT_HEADER_PAGES; i--) {
+            page_t* page = segment->pages + i;
+            if (page->type == GARBAGE_OBJ)
+                continue;
+            g_num_used_objs += page->num_marked;
+            if (page->num_marked == 0) {
+                _page_finalize(page);
+                page->type = GARBAGE_OBJ;
+                page->dirty = 1;
+            } else if (major || page->young || page->sweep_state == PAGE_UNSWEPT) {
+                page->sweep_state = PAGE_UNSWEPT;
+                g_size_classes[page->size_class].sweep_end++;
+            } else if (page->free_cells) {
+                size_class_t* size_class = g_size_classes + page->size_class;
+                page->next = size_class->pages;
+                size_class->pages = page;
+            }
+            page->young = 0;
+        }
+        _segment_link_free_pages(segment);
+        g_num_free_pages += segment->num_free_pages;
+    }
+
+    // lay the queue out by size class, then fill it.
+    g_sweep_queue_size = 0;
+    for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+        size_class_t* size_class = g_size_classes + i;
+        size_class->sweep_cursor = g_sweep_queue_size;
+        g_sweep_queue_size += size_class->sweep_end;
+        size_class->sweep_end = size_class->sweep_cursor;
+    }
+    for (segment = g_segments; segment; segment = segment->next) {
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++) {
+            page_t* page = segment->pages + i;
+            if (page->type != GARBAGE_OBJ && page->sweep_state == PAGE_UNSWEPT)
+                g_sweep_queue[g_size_classes[page->size_class].sweep_end++] = page;
+        }
+    }
+
+    int used_pages = g_num_segments * SEGMENT_USABLE_PAGES - g_num_free_pages;
+    size_t used_size = (size_t)used_pages * PAGE_SIZE;
+    if (major) {
+        // grow the heap if it's getting full, otherwise give memory back.
+        if (used_size > _heap_size() * HEAP_GROW_THRESHOLD)
+            _heap_grow((size_t)(_heap_size() * g_heap_growth_factor));
         else
-            obj->mark = g_mark;
+            _heap_release();
+        g_major_live_pages = used_pages;
+        g_next_gc_major = 0;
+    } else {
+        int nursery_pages = (int)(g_nursery_size / PAGE_SIZE);
+        g_next_gc_major = used_pages > 2 * g_major_live_pages + nursery_pages ||
+                          used_size > _heap_size() * HEAP_GROW_THRESHOLD;
+    }
+    g_nursery_used = 0;
+    g_gc_poll_at = g_nursery_size;
 
-        switch (obj->type) {
-        case SYMBOL_OBJ:
-        case NUMBER_OBJ:
-        case PRIM_FORM_OBJ:
-        case PRIM_PROC_OBJ:
-            // These objs don't reference anything.
-            break;
-        case PAIR_OBJ:
-            _gc_mark(obj->data.pair.car);
-            _gc_mark(obj->data.pair.cdr);
-            break;
-        case ENV_OBJ:
-            _gc_mark(obj->data.env.plist);
-            _gc_mark(obj->data.env.parent);
-            break;
-        case COMP_PROC_OBJ:
-            _gc_mark(obj->data.comp_proc.formals);
-            _gc_mark(obj->data.comp_proc.env);
-            _gc_mark(obj->data.comp_proc.body);
-            break;
-        default:
-            assert(0);  // bad obj type!
-            break;
+    _sweeper_resume();
+}
+
+static uint64_t _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// called once a gc is done, with its marks counted by _gc_finish().
+static void _gc_finished(int major)
+{
+    if (major) {
+        g_gc_stats.num_major_gcs++;
+        g_gc_stats.last_survivors = g_num_used_objs;
+    } else {
+        // old objs keep their marks, the rest of the live objs were young.
+        g_gc_stats.num_minor_gcs++;
+        g_gc_stats.last_survivors = g_num_used_objs - g_gc_stats.live_objs;
+    }
+    g_gc_stats.total_survivors += g_gc_stats.last_survivors;
+    g_gc_stats.live_objs = g_num_used_objs;
+    g_gc_finished = major ? "major" : "minor";
+}
+
+// the mutator is stopped from the outermost begin to its end.
+static void _gc_pause_begin()
+{
+    if (g_gc_pause_depth++ == 0)
+        g_gc_pause_start = _now_ns();
+}
+
+static void _gc_pause_end()
+{
+    if (--g_gc_pause_depth > 0)
+        return;
+    uint64_t pause_ns = _now_ns() - g_gc_pause_start;
+    g_gc_stats.total_pause_ns += pause_ns;
+    if (pause_ns > g_gc_stats.max_pause_ns)
+        g_gc_stats.max_pause_ns = pause_ns;
+    if (g_gc_log && g_gc_finished)
+        fprintf(stderr, "gc: %s, %.3f ms pause, %d survivors, %d live objs, %d free pages\n",
+                g_gc_finished, pause_ns / 1e6, g_gc_stats.last_survivors, g_gc_stats.live_objs,
+                g_num_free_pages);
+    g_gc_finished = NULL;
+}
+
+// marks until the mark stack is empty or the pause budget is used up.
+static void _gc_mark_slice()
+{
+    mark_worker_t* worker = g_mark_workers;
+    uint64_t deadline = _now_ns() + (uint64_t)g_gc_pause_us * 1000;
+    int n = 0;
+    while (worker->local.size) {
+        _gc_scan(worker, worker->local.objs[--worker->local.size]);
+        if (++n % 64 == 0 && _now_ns() >= deadline) {
+            g_gc_poll_at = g_nursery_used + ((size_t)g_gc_slice_allocs << GRANULE_SHIFT);
+            return;
         }
     }
+    _gc_finish(1);
+    _gc_finished(1);
+}
+
+// snapshots the roots, the rest of the marking is done in slices.
+static void _gc_start_marking()
+{
+    _sweeper_pause();
+    _c_stack_find_roots();
+    _gc_clear_marks();
+    g_gc_marking = 1;
+    _mark_roots(g_mark_workers, 1);
+    _gc_mark_slice();
+}
+
+// called from the allocator once g_gc_poll_at bytes have been allocated.
+static void _gc_poll()
+{
+    _gc_pause_begin();
+    if (g_gc_marking && g_gc_pause_us)
+        _gc_mark_slice();
+    else if (!g_gc_marking && g_gc_pause_us && g_next_gc_major)
+        _gc_start_marking();
+    else
+        _gc_collect(0);
+    _gc_pause_end();
+}
+
+// returns 1 if this turned out to be a major gc.  An incremental gc in
+// progress is finished off without pausing.
+static int _gc_collect(int major)
+{
+    _gc_pause_begin();
+    _sweeper_pause();
+
+    if (g_gc_marking) {
+        major = 1;
+        _gc_mark_all();
+    } else {
+        if (g_next_gc_major)
+            major = 1;
+        _c_stack_find_roots();
+        if (major)
+            _gc_clear_marks();
+        _mark_roots(g_mark_workers, major);
+        _gc_mark_all();
+    }
+    _gc_finish(major);
+    _gc_finished(major);
+
+    _gc_pause_end();
+    return major;
+}
+
+void obj_gc()
+{
+    _gc_collect(1);
+}
+
+void obj_set_gc_log(int enabled)
+{
+    g_gc_log = enabled;
+}
+
+void obj_get_gc_stats(obj_gc_stats_t* stats)
+{
+    *stats = g_gc_stats;
+    stats->live_objs = g_num_used_objs;
+    stats->heap_size = _heap_size();
+    stats->free_pages = g_num_free_pages;
+    stats->max_vm_stack_objs = vm_max_depth();
+}
+
+//
+// compaction
+//
+// obj_compact() copies every obj but symbols into fresh pages, then frees
+// the pages they came from.  Unlike Cheney's breadth first scan, which would
+// interleave every list that's reachable at the same depth, copied objs are
+// scanned off a stack, the cdr last copied is scanned next.  So the cells of
+// a list end up next to each other, in the order they're walked.  Symbols
+// stay put, C code keeps pointers to some of them.  A mark bit on an
+// evacuated page means the obj has been copied, and its first word is the
+// new address.
+//
+
+// bump allocates a copy in to-space, which is just pages taken off the free list.
+static obj_t* _compact_alloc(size_class_t* size_class)
+{
+    if (size_class->bump == size_class->bump_end) {
+        page_t* page = _page_alloc(size_class - g_size_classes);
+        assert(page);  // obj_compact() makes sure there are enough free pages.
+    }
+    obj_t* obj = (obj_t*)size_class->bump;
+    size_class->bump += size_class->cell_size;
+    return obj;
+}
+
+static obj_t* _compact_forward(mark_stack_t* copied, obj_t* obj)
+{
+    if (obj_is_immediate(obj))
+        return obj;
+    page_t* page = _page_of(obj);
+    if (!page->moving)
+        return obj;
+    if (_is_marked(obj))
+        return CELL_WORD(obj, 0);
+
+    size_class_t* size_class = g_size_classes + page->size_class;
+    obj_t* new_obj = _compact_alloc(size_class);
+    memcpy(new_obj, obj, size_class->cell_size);
+    _gc_test_and_set_mark(obj);
+    _gc_test_and_set_mark(new_obj);  // copies are old
+    CELL_WORD(obj, 0) = new_obj;
+    if (page->type == CODE_OBJ)
+        obj->data.code.bytecode = NULL;  // the copy owns it now
+    _mark_stack_push(copied, new_obj);
+    return new_obj;
+}
+
+static void _compact_scan(mark_stack_t* copied, obj_t* obj)
+{
+    switch (obj_get_type(obj)) {
+    case SYMBOL_OBJ:
+    case PRIM_FORM_OBJ:
+    case PRIM_PROC_OBJ:
+        break;
+    case PAIR_OBJ:
+        obj->data.pair.car = _compact_forward(copied, obj->data.pair.car);
+        obj->data.pair.cdr = _compact_forward(copied, obj->data.pair.cdr);
+        break;
+    case ENV_OBJ:
+        obj->data.env.plist = _compact_forward(copied, obj->data.env.plist);
+        obj->data.env.parent = _compact_forward(copied, obj->data.env.parent);
+        break;
+    case FRAME_OBJ:
+    {
+        int i, n = _frame_num_slots(obj);
+        obj->data.frame.plist = _compact_forward(copied, obj->data.frame.plist);
+        obj->data.frame.parent = _compact_forward(copied, obj->data.frame.parent);
+        obj->data.frame.names = _compact_forward(copied, obj->data.frame.names);
+        for (i = 0; i < n; i++)
+            obj->data.frame.slots[i] = _compact_forward(copied, obj->data.frame.slots[i]);
+        break;
+    }
+    case COMP_PROC_OBJ:
+        obj->data.comp_proc.formals = _compact_forward(copied, obj->data.comp_proc.formals);
+        obj->data.comp_proc.env = _compact_forward(copied, obj->data.comp_proc.env);
+        obj->data.comp_proc.body = _compact_forward(copied, obj->data.comp_proc.body);
+        break;
+    case CODE_OBJ:
+    {
+        bytecode_t* bytecode = obj->data.code.bytecode;
+        int i;
+        obj->data.code.source = _compact_forward(copied, obj->data.code.source);
+        for (i = 0; i < bytecode->num_consts; i++)
+            bytecode->consts[i] = _compact_forward(copied, bytecode->consts[i]);
+        break;
+    }
+    default:
+        assert(0);  // bad obj type!
+        break;
+    }
 }
 
-void obj_gc()
+int obj_compact()
 {
-#if GC_DEBUG
-    // _dump_list("g_used_objs", g_used_objs);
-#endif
+    _gc_pause_begin();
 
-    // mark phase
-    g_mark++;
-    assert(obj_is_environment(g_env));
-    _gc_mark(g_env);
+    // a full gc first, so the live objs are known to fit in the free pages.
+    _gc_collect(1);
+    _sweeper_pause();
 
+    segment_t* segment;
     int i;
-    for (i = 0; i < g_num_stack_objs; ++i)
-        _gc_mark(g_stack[i]);
-
-    // sweep phase
-    obj_t* p = g_used_objs;
-#ifndef NDEBUG
-    int initial_count = _pool_num_used();
-    int count = initial_count;
-#endif
-    while (p) {
-        obj_t* obj = p;
-        p = p->next;
-        if (obj->mark != g_mark) {
-            _pool_free(obj);
-#ifndef NDEBUG
-            count--;
-#endif
+    int num_moving_pages = 0;
+    for (segment = g_segments; segment; segment = segment->next)
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++)
+            if (segment->pages[i].type != GARBAGE_OBJ && segment->pages[i].type != SYMBOL_OBJ)
+                num_moving_pages++;
+    int num_needed_pages = num_moving_pages + NUM_SIZE_CLASSES;  // a partial page per size class
+    if (g_num_free_pages < num_needed_pages)
+        _heap_grow(_heap_size() + (size_t)(num_needed_pages - g_num_free_pages) * PAGE_SIZE + SEGMENT_SIZE);
+    if (g_num_free_pages < num_needed_pages) {
+        _sweeper_resume();
+        _gc_pause_end();
+        return 0;
+    }
+
+    // pages holding objs the c stack points at are pinned.
+    _c_stack_find_roots();
+    for (segment = g_segments; segment; segment = segment->next)
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++)
+            segment->pages[i].moving = segment->pages[i].type != GARBAGE_OBJ && segment->pages[i].type != SYMBOL_OBJ;
+    for (i = 0; i < g_num_c_roots; i++)
+        _page_of(g_c_roots[i])->moving = 0;
+
+    // from here on a mark bit on a moving page means forwarded.  The live
+    // objs of pinned pages are scanned like copies, so what they point at
+    // gets moved too.
+    mark_stack_t* copied = &g_mark_workers[0].local;
+    assert(copied->size == 0);
+    for (segment = g_segments; segment; segment = segment->next) {
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++) {
+            page_t* page = segment->pages + i;
+            if (page->moving) {
+                memset(segment->mark_bits + i * (GRANULES_PER_PAGE / 64), 0, GRANULES_PER_PAGE / 8);
+                page->num_marked = 0;
+            } else if (page->type != GARBAGE_OBJ && page->type != SYMBOL_OBJ) {
+                char* start = _page_start(page);
+                char* p;
+                for (p = start; p + page->cell_size <= start + PAGE_SIZE; p += page->cell_size)
+                    if (_is_marked((obj_t*)p))
+                        _mark_stack_push(copied, (obj_t*)p);
+            }
         }
     }
-    assert(_pool_num_used() == count);
-}
+    for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+        g_size_classes[i].bump = NULL;
+        g_size_classes[i].bump_end = NULL;
+    }
 
-//
-// stack which prevents gc from collecting intermediate results.
-//
+    g_env = _compact_forward(copied, g_env);
+    obj_t** p;
+    for (p = g_vm_stack; p < g_vm_sp; p++)
+        *p = _compact_forward(copied, *p);
+    while (copied->size)
+        _compact_scan(copied, copied->objs[--copied->size]);
+
+    // the evacuated pages are left with nothing marked, so they get freed.
+    for (segment = g_segments; segment; segment = segment->next) {
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++) {
+            page_t* page = segment->pages + i;
+            if (page->moving) {
+                memset(segment->mark_bits + i * (GRANULES_PER_PAGE / 64), 0, GRANULES_PER_PAGE / 8);
+                page->num_marked = 0;
+                page->moving = 0;
+            }
+        }
+    }
 
-static void _stack_init()
-{
-    g_num_stack_objs = 0;
-    g_num_stack_frames = 0;
+    _global_cells_rebuild();
+    g_env_cells_epoch++;
+    _gc_finish(1);
+    g_gc_stats.num_compactions++;
+    g_gc_stats.live_objs = g_num_used_objs;
+    g_gc_finished = "compact";
+    _gc_pause_end();
+    return 1;
 }
 
-void obj_stack_frame_push()
-{
-    assert(g_num_stack_frames < MAX_STACK_FRAMES);  // stack frame overflow.
-    g_stack_frames[g_num_stack_frames++] = g_num_stack_objs;
-}
+//
+// errors
+//
 
-void obj_stack_frame_pop()
+void obj_handler_push(obj_handler_t* handler)
 {
-    assert(g_num_stack_frames > 0);  // stack frame underflow.
-    g_num_stack_frames--;
-    g_num_stack_objs = g_stack_frames[g_num_stack_frames];
+    handler->vm_sp = g_vm_sp;
+    handler->prev = g_handler;
+    g_handler = handler;
 }
 
-obj_t* obj_stack_push(obj_t* obj)
+void obj_handler_pop(obj_handler_t* handler)
 {
-    assert(g_num_stack_objs < MAX_STACK_OBJS);  // stack overflow
-    g_stack[g_num_stack_objs++] = obj;
-    return obj;
+    assert(g_handler == handler);  // handlers must be popped in order.
+    g_handler = handler->prev;
 }
 
-static int _stack_index(int i)
+void obj_error(const char* format, ...)
 {
-    assert(g_num_stack_frames > 0);  // no stack frames!
-    int bottom = g_stack_frames[g_num_stack_frames - 1];
-    if (i >= 0) {
-        assert(bottom + i < g_num_stack_objs);  // past the top.
-        return bottom + i;
-    } else {
-        assert(g_num_stack_objs + i >= bottom);  // past the bottom.
-        return g_num_stack_objs + i;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(g_error_message, sizeof(g_error_message), format, args);
+    va_end(args);
+
+    obj_handler_t* handler = g_handler;
+    if (!handler) {
+        fprintf(stderr, "ERROR: %s\n", g_error_message);
+        exit(1);
     }
+
+    // the frames pushed since the handler was pushed are gone.
+    g_handler = handler->prev;
+    g_vm_sp = handler->vm_sp;
+    longjmp(handler->jmp, 1);
 }
 
-// negative indices are from the top of the stack.
-// positive indices are from the bottom.
-// -1 is the top of the stack
-// 0 is the bottom of the stack.
-obj_t* obj_stack_get(int i)
+const char* obj_error_message()
 {
-    return g_stack[_stack_index(i)];
+    return g_error_message;
 }
 
-void obj_stack_set(int i, obj_t* obj)
+char* obj_c_stack_limit()
 {
-    g_stack[_stack_index(i)] = obj;
+    return g_c_stack_base - g_c_stack_limit;
 }
 
-void obj_stack_dump(const char* desc)
+void obj_check_c_stack()
 {
-    printf("%s = \n", desc);
-    printf("    stack_frames : [");
-    int i = 0;
-    for (i = 0; i < g_num_stack_frames; i++) {
-        printf(" %d ", g_stack_frames[i]);
-    }
-    printf("]\n");
-
-    printf("    stack_objs : [");
-    for (i = 0; i < g_num_stack_objs; i++) {
-        printf(" %p ", g_stack[i]);
+    size_t depth = g_c_stack_base - (char*)__builtin_frame_address(0);
+    if (depth > g_gc_stats.max_c_stack_bytes) {
+        if (depth > g_c_stack_limit)
+            obj_error("c stack overflow, recursion is too deep");
+        g_gc_stats.max_c_stack_bytes = depth;
     }
-    printf("]\n");
 }
 
 //
@@ -299,31 +1599,29 @@ void obj_stack_dump(const char* desc)
 
 obj_t* obj_make_symbol(const char* str)
 {
-    int len = strlen(str);
-    int id = symbol_find(str, len);
-    if (id < 0)
-        id = symbol_add(str, len);
-
-    obj_t* obj = _pool_alloc();
-    obj->type = SYMBOL_OBJ;
-    obj->data.symbol = id;
-
-#ifdef GC_DEBUG
-    fprintf(stderr, "ALLOC obj %p, symbol = %s\n", obj, symbol_get(id));
-#endif
-    return obj;
+    return obj_make_symbol2(str, str + strlen(str));
 }
 
+// symbols are interned, there is only ever one symbol obj per symbol id.
 obj_t* obj_make_symbol2(const char* start, const char* end)
 {
-    int len = end - start;
-    int id = symbol_find(start, len);
-    if (id < 0)
-        id = symbol_add(start, len);
+    int id = symbol_intern(start, end - start);
+
+    if (id < g_symbol_objs_capacity && g_symbol_objs[id])
+        return g_symbol_objs[id];
+
+    if (id >= g_symbol_objs_capacity) {
+        int new_capacity = g_symbol_objs_capacity ? g_symbol_objs_capacity * 2 : 256;
+        while (new_capacity <= id)
+            new_capacity *= 2;
+        g_symbol_objs = (obj_t**)realloc(g_symbol_objs, sizeof(obj_t*) * new_capacity);
+        memset(g_symbol_objs + g_symbol_objs_capacity, 0, sizeof(obj_t*) * (new_capacity - g_symbol_objs_capacity));
+        g_symbol_objs_capacity = new_capacity;
+    }
 
-    obj_t* obj = _pool_alloc();
-    obj->type = SYMBOL_OBJ;
+    obj_t* obj = _heap_alloc(SYMBOL_OBJ);
     obj->data.symbol = id;
+    g_symbol_objs[id] = obj;
 
 #ifdef GC_DEBUG
     fprintf(stderr, "ALLOC obj %p, symbol = %s\n", obj, symbol_get(id));
@@ -333,14 +1631,12 @@ obj_t* obj_make_symbol2(const char* start, const char* end)
 
 obj_t* obj_make_number(double num)
 {
-    obj_t* obj = _pool_alloc();
-    obj->type = NUMBER_OBJ;
-    obj->data.number = num;
-
-#ifdef GC_DEBUG
-    fprintf(stderr, "ALLOC obj %p, number = %f\n", obj, num);
-#endif
-    return obj;
+    uint64_t bits;
+    if (num != num)
+        bits = 0x7ff8000000000000;  // canonical quiet NaN
+    else
+        memcpy(&bits, &num, sizeof(double));
+    return (obj_t*)(bits + NUMBER_OFFSET);
 }
 
 obj_t* obj_make_number2(const char* start, const char* end)
@@ -359,8 +1655,7 @@ obj_t* obj_make_number2(const char* start, const char* end)
 
 obj_t* obj_make_pair(obj_t* car, obj_t* cdr)
 {
-    obj_t* obj = _pool_alloc();
-    obj->type = PAIR_OBJ;
+    obj_t* obj = _heap_alloc(PAIR_OBJ);
     obj->data.pair.car = car;
     obj->data.pair.cdr = cdr;
 
@@ -372,8 +1667,7 @@ obj_t* obj_make_pair(obj_t* car, obj_t* cdr)
 
 obj_t* obj_make_environment(obj_t* plist, obj_t* parent)
 {
-    obj_t* obj = _pool_alloc();
-    obj->type = ENV_OBJ;
+    obj_t* obj = _heap_alloc(ENV_OBJ);
     obj->data.env.plist = plist;
     obj->data.env.parent = parent;
 
@@ -383,11 +1677,10 @@ obj_t* obj_make_environment(obj_t* plist, obj_t* parent)
     return obj;
 }
 
-obj_t* obj_make_prim_form(prim_func_t prim_func)
+obj_t* obj_make_prim_form(form_func_t form_func)
 {
-    obj_t* obj = _pool_alloc();
-    obj->type = PRIM_FORM_OBJ;
-    obj->data.prim_func = prim_func;
+    obj_t* obj = _heap_alloc(PRIM_FORM_OBJ);
+    obj->data.form_func = form_func;
 
 #ifdef GC_DEBUG
     fprintf(stderr, "ALLOC obj %p, prim_form\n", obj);
@@ -395,11 +1688,12 @@ obj_t* obj_make_prim_form(prim_func_t prim_func)
     return obj;
 }
 
-obj_t* obj_make_prim_proc(prim_func_t prim_func)
+obj_t* obj_make_prim_proc(prim_func_t func, prim_func1_t func1, prim_func2_t func2)
 {
-    obj_t* obj = _pool_alloc();
-    obj->type = PRIM_PROC_OBJ;
-    obj->data.prim_func = prim_func;
+    obj_t* obj = _heap_alloc(PRIM_PROC_OBJ);
+    obj->data.prim_proc.func = func;
+    obj->data.prim_proc.func1 = func1;
+    obj->data.prim_proc.func2 = func2;
 
 #ifdef GC_DEBUG
     fprintf(stderr, "ALLOC obj %p, prim_proc\n", obj);
@@ -409,11 +1703,11 @@ obj_t* obj_make_prim_proc(prim_func_t prim_func)
 
 obj_t* obj_make_comp_proc(obj_t* formals, obj_t* env, obj_t* body)
 {
-    obj_t* obj = _pool_alloc();
-    obj->type = COMP_PROC_OBJ;
+    obj_t* obj = _heap_alloc(COMP_PROC_OBJ);
     obj->data.comp_proc.formals = formals;
     obj->data.comp_proc.env = env;
     obj->data.comp_proc.body = body;
+    obj->data.comp_proc.serial = ++g_comp_proc_serial;
 
 #ifdef GC_DEBUG
     fprintf(stderr, "ALLOC obj %p, comp_proc\n", obj);
@@ -421,6 +1715,48 @@ obj_t* obj_make_comp_proc(obj_t* formals, obj_t* env, obj_t* body)
     return obj;
 }
 
+obj_t* obj_make_code(obj_t* source, bytecode_t* bytecode)
+{
+    obj_t* obj = _heap_alloc(CODE_OBJ);
+    obj->data.code.source = source;
+    obj->data.code.bytecode = bytecode;
+
+#ifdef GC_DEBUG
+    fprintf(stderr, "ALLOC obj %p, code\n", obj);
+#endif
+    return obj;
+}
+
+// the smallest frame size class with room for num_slots.
+static int _frame_size_class(int num_slots)
+{
+    int bytes = (int)(sizeof(frame_t) + sizeof(obj_t*) * num_slots);
+    int i = FRAME_OBJ;
+    assert(num_slots <= FRAME_MAX_SLOTS);
+    while (g_size_classes[i].cell_size < bytes)
+        i = i == FRAME_OBJ ? GARBAGE_OBJ : i + 1;
+    return i;
+}
+
+obj_t* obj_make_frame(obj_t* parent, obj_t* names, int num_slots, int num_args, obj_t** args)
+{
+    obj_t* obj = _heap_alloc_class(_frame_size_class(num_slots));
+    int n = _frame_num_slots(obj);
+    int i;
+    obj->data.frame.plist = KNULL;
+    obj->data.frame.parent = parent;
+    obj->data.frame.names = names;
+    for (i = 0; i < num_args; i++)
+        obj->data.frame.slots[i] = args[i];
+    for (; i < n; i++)
+        obj->data.frame.slots[i] = KNULL;
+
+#ifdef GC_DEBUG
+    fprintf(stderr, "ALLOC obj %p, frame\n", obj);
+#endif
+    return obj;
+}
+
 //
 // obj type predicates
 //
@@ -428,13 +1764,14 @@ obj_t* obj_make_comp_proc(obj_t* formals, obj_t* env, obj_t* body)
 int obj_is_garbage(obj_t* obj) // for debugging gc
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == GARBAGE_OBJ;
+    return !obj_is_immediate(obj) && CELL_WORD(obj, 1) == KFREE;
 }
 
+// numbers and constants, anything that is not a pointer to a heap obj.
 int obj_is_immediate(obj_t* obj)
 {
     assert(obj);
-    return (long)obj & IMM_TAG;
+    return ((uint64_t)obj & (NUMBER_MASK | IMM_TAG)) != 0;
 }
 
 int obj_is_boolean(obj_t* obj)
@@ -452,67 +1789,85 @@ int obj_is_null(obj_t* obj)
 int obj_is_symbol(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == SYMBOL_OBJ;
+    return !obj_is_immediate(obj) && obj_get_type(obj) == SYMBOL_OBJ;
 }
 
 int obj_is_number(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == NUMBER_OBJ;
+    return ((uint64_t)obj & NUMBER_MASK) != 0;
 }
 
 int obj_is_pair(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == PAIR_OBJ && !obj_is_null(obj);
+    return !obj_is_immediate(obj) && obj_get_type(obj) == PAIR_OBJ && !obj_is_null(obj);
 }
 
 int obj_is_environment(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == ENV_OBJ;
+    if (obj_is_immediate(obj))
+        return 0;
+    enum obj_type type = obj_get_type(obj);
+    return type == ENV_OBJ || type == FRAME_OBJ;
 }
 
 int obj_is_prim_form(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == PRIM_FORM_OBJ;
+    return !obj_is_immediate(obj) && obj_get_type(obj) == PRIM_FORM_OBJ;
 }
 
 int obj_is_prim_proc(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == PRIM_PROC_OBJ;
+    return !obj_is_immediate(obj) && obj_get_type(obj) == PRIM_PROC_OBJ;
 }
 
 int obj_is_comp_proc(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && obj->type == COMP_PROC_OBJ;
+    return !obj_is_immediate(obj) && obj_get_type(obj) == COMP_PROC_OBJ;
 }
 
 int obj_is_proc(obj_t* obj)
 {
     assert(obj);
-    return !obj_is_immediate(obj) && (obj->type == PRIM_PROC_OBJ || obj->type == COMP_PROC_OBJ);
+    return !obj_is_immediate(obj) && (obj_get_type(obj) == PRIM_PROC_OBJ || obj_get_type(obj) == COMP_PROC_OBJ);
+}
+
+int obj_is_code(obj_t* obj)
+{
+    assert(obj);
+    return !obj_is_immediate(obj) && obj_get_type(obj) == CODE_OBJ;
+}
+
+double obj_number(obj_t* obj)
+{
+    assert(obj_is_number(obj));
+    uint64_t bits = (uint64_t)obj - NUMBER_OFFSET;
+    double num;
+    memcpy(&num, &bits, sizeof(double));
+    return num;
 }
 
 obj_t* obj_cons(obj_t* a, obj_t* b)
 {
-    PUSHF();
-    PUSH2(a, b);
-    POPF_RET(obj_make_pair(a, b));
+    return obj_make_pair(a, b);
 }
 
 obj_t* obj_car(obj_t* obj)
 {
-    assert(obj_is_pair(obj));
+    if (!obj_is_pair(obj))
+        obj_error("car of a non-pair");
     return obj->data.pair.car;
 }
 
 obj_t* obj_cdr(obj_t* obj)
 {
-    assert(obj_is_pair(obj));
+    if (!obj_is_pair(obj))
+        obj_error("cdr of a non-pair");
     return obj->data.pair.cdr;
 }
 
@@ -523,31 +1878,26 @@ obj_t* obj_cadr(obj_t* obj)
 
 void obj_set_car(obj_t* obj, obj_t* value)
 {
-    assert(obj_is_pair(obj));
+    if (!obj_is_pair(obj))
+        obj_error("set-car! of a non-pair");
+    _write_barrier(obj, obj->data.pair.car, value);
     obj->data.pair.car = value;
 }
 
 void obj_set_cdr(obj_t* obj, obj_t* value)
 {
-    assert(obj_is_pair(obj));
+    if (!obj_is_pair(obj))
+        obj_error("set-cdr! of a non-pair");
+    _write_barrier(obj, obj->data.pair.cdr, value);
     obj->data.pair.cdr = value;
 }
 
 int obj_is_eq(obj_t* a, obj_t* b)
 {
-    if (obj_is_immediate(a) && obj_is_immediate(b)) {
-        return a == b;
-    } else if (!obj_is_immediate(a) && !obj_is_immediate(b) && a->type == b->type) {
-        switch (a->type) {
-        case SYMBOL_OBJ:
-            return a->data.symbol == b->data.symbol;
-        case NUMBER_OBJ:
-            return a->data.number == b->data.number;
-        default:
-            return a == b;
-        }
-    }
-    return 0;
+    // symbols are interned, so everything but numbers is compared by pointer.
+    if (obj_is_number(a) && obj_is_number(b))
+        return obj_number(a) == obj_number(b);
+    return a == b;
 }
 
 int obj_is_equal(obj_t* a, obj_t* b)
@@ -563,26 +1913,48 @@ int obj_is_equal(obj_t* a, obj_t* b)
         return obj_is_eq(a, b);
 }
 
-obj_t* obj_env_lookup(obj_t* env, obj_t* symbol)
+obj_t** obj_env_find(obj_t* env, obj_t* symbol)
 {
     assert(obj_is_symbol(symbol));
     assert(obj_is_environment(env));
 
-    obj_t* pair = _assq(symbol, env->data.env.plist);
-    if (!obj_is_null(pair)) {
-        return obj_cdr(pair);
+    // a loop rather than recursion, env chains can get deep.  Frames and
+    // envs start the same, so either one's plist and parent are in env.
+    while (1) {
+        if (env == g_env) {
+            obj_t* pair = _global_cell(symbol);
+            return pair ? &pair->data.pair.cdr : NULL;
+        }
+        if (obj_get_type(env) == FRAME_OBJ) {
+            int i = _frame_index(env, symbol);
+            if (i >= 0)
+                return env->data.frame.slots + i;
+        }
+        obj_t* pair = _assq(symbol, env->data.env.plist);
+        if (!obj_is_null(pair))
+            return &pair->data.pair.cdr;
+        if (!obj_is_environment(env->data.env.parent))
+            return NULL;
+        env = env->data.env.parent;
     }
-    else {
-        if (obj_is_environment(env->data.env.parent))
-            return obj_env_lookup(env->data.env.parent, symbol);
-        else {
+}
 
-            // AJT: REMOVE
-            fprintf(stderr, "Warning: could not find symbol \"%s\" in env\n", symbol_get(symbol->data.symbol));
+obj_t* obj_env_lookup(obj_t* env, obj_t* symbol)
+{
+    obj_t** value = obj_env_find(env, symbol);
+    return value ? *value : KNULL;
+}
 
-            return KNULL;
-        }
-    }
+obj_t** obj_env_cache_cell(obj_t* env, obj_t* symbol)
+{
+    obj_t** cell = obj_env_find(env, symbol);
+    if (!cell)
+        return NULL;
+    global_cell_t* info = _global_cell_info(symbol);
+    if (info->in_frame_plist)
+        return NULL;
+    info->cached = g_env_cells_epoch;
+    return cell;
 }
 
 void obj_env_define(obj_t* env, obj_t* symbol, obj_t* value)
@@ -590,18 +1962,90 @@ void obj_env_define(obj_t* env, obj_t* symbol, obj_t* value)
     assert(obj_is_symbol(symbol));
     assert(obj_is_environment(env));
 
-    PUSHF();
-    PUSH3(env, symbol, value);
-    obj_t* pair = PUSH(_assq(symbol, env->data.env.plist));
-    if (obj_is_null(pair)) {
+    if (obj_get_type(env) == FRAME_OBJ) {
+        int i = _frame_index(env, symbol);
+        if (i >= 0) {
+            obj_frame_set(env, i, value);
+            return;
+        }
+    }
+    obj_t* pair = env == g_env ? _global_cell(symbol) : _assq(symbol, env->data.env.plist);
+    if (!pair || obj_is_null(pair)) {
         // did not find it. so add a new property to the beginning of the plist.
-        pair = PUSH(obj_cons(symbol, value));
-        env->data.env.plist = obj_cons(pair, env->data.env.plist);
+        pair = obj_cons(symbol, value);
+        obj_t* plist = obj_cons(pair, env->data.env.plist);
+        _write_barrier(env, env->data.env.plist, plist);
+        env->data.env.plist = plist;
+        // nothing is further out than g_env, so only a binding in another
+        // env can hide a cached cell.
+        global_cell_t* info = _global_cell_info(symbol);
+        if (env == g_env) {
+            info->pair = pair;
+        } else {
+            if (obj_get_type(env) == FRAME_OBJ)
+                info->in_frame_plist = 1;
+            if (info->cached == g_env_cells_epoch)
+                g_env_cells_epoch++;
+        }
     } else {
         // found it, change the value
         obj_set_cdr(pair, value);
     }
-    POPF();
+}
+
+void obj_frame_set(obj_t* frame, int index, obj_t* value)
+{
+    assert(obj_get_type(frame) == FRAME_OBJ);
+    _write_barrier(frame, frame->data.frame.slots[index], value);
+    frame->data.frame.slots[index] = value;
+}
+
+// g_env's pair for symbol, or NULL.
+static obj_t* _global_cell(obj_t* symbol)
+{
+    int id = symbol->data.symbol;
+    return id < g_global_cells_capacity ? g_global_cells[id].pair : NULL;
+}
+
+static global_cell_t* _global_cell_info(obj_t* symbol)
+{
+    int id = symbol->data.symbol;
+    if (id >= g_global_cells_capacity) {
+        int capacity = g_global_cells_capacity ? g_global_cells_capacity : 256;
+        while (capacity <= id)
+            capacity *= 2;
+        g_global_cells = (global_cell_t*)realloc(g_global_cells, sizeof(global_cell_t) * capacity);
+        assert(g_global_cells);
+        memset(g_global_cells + g_global_cells_capacity, 0,
+               sizeof(global_cell_t) * (capacity - g_global_cells_capacity));
+        g_global_cells_capacity = capacity;
+    }
+    return g_global_cells + id;
+}
+
+// the plist is newest first, and the first pair for a symbol is its binding.
+static void _global_cells_rebuild()
+{
+    int i;
+    for (i = 0; i < g_global_cells_capacity; i++)
+        g_global_cells[i].pair = NULL;
+    obj_t* plist;
+    for (plist = g_env->data.env.plist; obj_is_pair(plist); plist = obj_cdr(plist))
+        if (!_global_cell(obj_car(obj_car(plist))))
+            _global_cell_info(obj_car(obj_car(plist)))->pair = obj_car(plist);
+}
+
+// the slot of symbol in the frame, the last one if it's repeated like the
+// compiler picks, or -1.
+static int _frame_index(obj_t* frame, obj_t* symbol)
+{
+    int index = -1;
+    int i;
+    obj_t* names = frame->data.frame.names;
+    for (i = 0; obj_is_pair(names); i++, names = obj_cdr(names))
+        if (obj_car(names) == symbol)
+            index = i;
+    return index;
 }
 
 // no gc
@@ -619,17 +2063,13 @@ static obj_t* _assq(obj_t* key, obj_t* plist)
 // debug output
 //
 
-#define PRINTF(args...)                          \
-    do {                                         \
-        if (to_stderr)                           \
-            fprintf(stderr, args);               \
-        else                                     \
-            printf(args);                        \
-    } while(0)
+#define PRINTF(args...) fprintf(fp, args)
 
-void obj_dump(obj_t* obj, int to_stderr)
+void obj_print(obj_t* obj, FILE* fp)
 {
-    if (obj_is_immediate(obj)) {
+    if (obj_is_number(obj)) {
+        PRINTF("%f", obj_number(obj));
+    } else if (obj_is_immediate(obj)) {
         if (obj == KTRUE)
             PRINTF("#t");
         else if (obj == KFALSE)
@@ -638,22 +2078,21 @@ void obj_dump(obj_t* obj, int to_stderr)
             PRINTF("()");
         else
             PRINTF("#<??? %p>", obj);
+    } else if (obj_is_garbage(obj)) {
+        PRINTF("#<garbage %p>", obj);
     } else {
-        switch (obj->type) {
-        case NUMBER_OBJ:
-            PRINTF("%f", obj->data.number);
-            break;
+        switch (obj_get_type(obj)) {
         case SYMBOL_OBJ:
             PRINTF("%s", symbol_get(obj->data.symbol));
             break;
         case PAIR_OBJ:
             PRINTF("(");
             while (obj_is_pair(obj)) {
-                obj_dump(obj_car(obj), to_stderr);
+                obj_print(obj_car(obj), fp);
                 obj = obj_cdr(obj);
                 if (!obj_is_null(obj) && !obj_is_pair(obj)) {
                     PRINTF(" . ");
-                    obj_dump(obj, to_stderr);
+                    obj_print(obj, fp);
                     break;
                 }
                 if (!obj_is_null(obj))
@@ -662,6 +2101,7 @@ void obj_dump(obj_t* obj, int to_stderr)
             PRINTF(")");
             break;
         case ENV_OBJ:
+        case FRAME_OBJ:
             PRINTF("#<env 0x%p>", obj);
             break;
         case PRIM_FORM_OBJ:
@@ -673,30 +2113,749 @@ void obj_dump(obj_t* obj, int to_stderr)
         case COMP_PROC_OBJ:
             PRINTF("#<comp-proc 0x%p>", obj);
             break;
-        case GARBAGE_OBJ:
-            PRINTF("#<garbage %p>", obj);
+        case CODE_OBJ:
+            PRINTF("#<code 0x%p>", obj);
             break;
         default:
-            PRINTF("#<? 0x%x>", obj->type);
+            PRINTF("#<? 0x%x>", obj_get_type(obj));
             break;
         }
     }
 }
 
+#undef PRINTF
+
+void obj_dump(obj_t* obj, int to_stderr)
+{
+    obj_print(obj, to_stderr ? stderr : stdout);
+}
+
 obj_t* obj_eval_expr(obj_t* obj, obj_t* env)
 {
-    PUSHF();
-    PUSH2(obj, env); // 0, 1
-    obj_t* args = PUSH(obj_cons(obj, KNULL)); // 2
-    POPF_RET(proc_eval(args, env));
+    return vm_eval(obj, env);
 }
 
 obj_t* obj_eval_str(const char* str, obj_t* env)
 {
-    PUSHF();
-    PUSH(env);
-    obj_t* expr = PUSH(read(str));
-    POPF_RET(obj_eval_expr(expr, env));
+    obj_t* expr = read_str(str);
+    return obj_eval_expr(expr, env);
+}
+
+//
+// heap images
+//
+// An image is the heap after a full gc, the symbol table and the names of the
+// prims.  Pages holding live objs are written out whole, along with their
+// address and mark bits, with the dead cells zeroed.  Loading copies each
+// page into a free page, then relocates every pointer in the live cells by
+// looking up the page it used to point into.  Prim funcs are written as
+// indices into the image's list of prim names, their addresses change from
+// build to build and, with ASLR, from run to run.  A code obj's bytecode is
+// written after the pages, and the obj holds its index in the list instead.
+//
+// The file is the header, the symbol names in id order, the prim names, the
+// address of each symbol's obj, the pages, then the bytecode, each one's
+// size followed by the block with the consts as they were.
+//
+
+#define IMAGE_MAGIC 0x38474d49534e4e42ULL  // "BNNSIMG8"
+
+typedef struct {
+    uint64_t magic;
+    uint32_t page_size;
+    uint32_t num_symbols;
+    uint32_t num_prims;
+    uint32_t num_codes;
+    uint32_t num_pages;
+    uint64_t env;
+} image_header_t;
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size_class;
+    uint64_t mark_bits[GRANULES_PER_PAGE / 64];
+} image_page_t;  // followed by the page itself
+
+// the image_page_t of a page in the file.  new_page is where the page is in
+// the file until it's been copied in.
+typedef struct {
+    image_page_t page;
+    char* new_page;
+} image_reloc_t;
+
+// the pages by the address they had when the image was saved.  Each segment
+// they were in gets a table of its pages, like the heap finds its own.
+typedef struct {
+    uint64_t addr;
+    image_reloc_t* pages[PAGES_PER_SEGMENT];  // NULL where the image has no page
+} image_segment_t;
+
+typedef struct {
+    image_reloc_t* relocs;
+    int num_relocs;
+    image_segment_t* segments;  // in address order
+    int num_segments;
+} image_map_t;
+
+typedef struct {
+    const char* p;
+    const char* end;
+} image_reader_t;
+
+static void _image_write_string(FILE* fp, const char* str)
+{
+    uint32_t len = strlen(str);
+    fwrite(&len, sizeof(len), 1, fp);
+    fwrite(str, 1, len, fp);
+}
+
+int obj_save_image(const char* filename)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (!fp)
+        return 0;
+
+    obj_gc();
+    _sweeper_pause();
+
+    segment_t* segment;
+    int i, j;
+    image_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.page_size = PAGE_SIZE;
+    header.num_symbols = symbol_count();
+    header.num_prims = prim_count();
+    for (segment = g_segments; segment; segment = segment->next) {
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++) {
+            if (segment->pages[i].type != GARBAGE_OBJ && segment->pages[i].num_marked) {
+                header.num_pages++;
+                if (segment->pages[i].type == CODE_OBJ)
+                    header.num_codes += segment->pages[i].num_marked;
+            }
+        }
+    }
+    header.env = (uint64_t)g_env;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for (i = 0; i < (int)header.num_symbols; i++)
+        _image_write_string(fp, symbol_get(i));
+    for (i = 0; i < (int)header.num_prims; i++)
+        _image_write_string(fp, prim_name(i));
+    for (i = 0; i < (int)header.num_symbols; i++) {
+        uint64_t addr = i < g_symbol_objs_capacity ? (uint64_t)g_symbol_objs[i] : 0;
+        fwrite(&addr, sizeof(addr), 1, fp);
+    }
+
+    int ok = 1;
+    char data[PAGE_SIZE];
+    bytecode_t** codes = (bytecode_t**)malloc(sizeof(bytecode_t*) * (header.num_codes + 1));
+    int num_codes = 0;
+    assert(codes);
+    for (segment = g_segments; segment; segment = segment->next) {
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++) {
+            page_t* page = segment->pages + i;
+            if (page->type == GARBAGE_OBJ || !page->num_marked)
+                continue;
+            char* start = _page_start(page);
+            image_page_t image_page;
+            image_page.addr = (uint64_t)start;
+            image_page.size_class = page->size_class;
+            memcpy(image_page.mark_bits, segment->mark_bits + i * (GRANULES_PER_PAGE / 64), sizeof(image_page.mark_bits));
+
+            memset(data, 0, PAGE_SIZE);
+            for (j = 0; j + page->cell_size <= PAGE_SIZE; j += page->cell_size) {
+                obj_t* obj = (obj_t*)(start + j);
+                if (!_is_marked(obj))
+                    continue;
+                memcpy(data + j, obj, page->cell_size);
+                if (page->type == PRIM_FORM_OBJ) {
+                    int index = prim_form_index(obj->data.form_func);
+                    ok = ok && index >= 0;  // made by the embedder, it can't be found again.
+                    ((obj_t*)(data + j))->data.form_func = (form_func_t)(intptr_t)index;
+                } else if (page->type == PRIM_PROC_OBJ) {
+                    int index = prim_index(obj->data.prim_proc.func);
+                    ok = ok && index >= 0;
+                    memset(data + j, 0, page->cell_size);
+                    ((obj_t*)(data + j))->data.prim_proc.func = (prim_func_t)(intptr_t)index;
+                } else if (page->type == CODE_OBJ) {
+                    ((obj_t*)(data + j))->data.code.bytecode = (bytecode_t*)(intptr_t)num_codes;
+                    codes[num_codes++] = obj->data.code.bytecode;
+                }
+            }
+            fwrite(&image_page, sizeof(image_page), 1, fp);
+            fwrite(data, PAGE_SIZE, 1, fp);
+        }
+    }
+    assert(num_codes == (int)header.num_codes);
+    for (i = 0; i < num_codes; i++) {
+        uint32_t size = BYTECODE_ALLOC_SIZE(codes[i]);
+        fwrite(&size, sizeof(size), 1, fp);
+        fwrite(codes[i], size, 1, fp);
+    }
+    free(codes);
+    _sweeper_resume();
+
+    ok = ok && !ferror(fp);
+    return fclose(fp) == 0 && ok;
+}
+
+// returns len bytes from the image, or NULL if it's too short.
+static const char* _image_read(image_reader_t* reader, size_t len)
+{
+    if ((size_t)(reader->end - reader->p) < len)
+        return NULL;
+    const char* p = reader->p;
+    reader->p += len;
+    return p;
+}
+
+static const char* _image_read_string(image_reader_t* reader, uint32_t* len)
+{
+    const char* p = _image_read(reader, sizeof(*len));
+    if (!p)
+        return NULL;
+    memcpy(len, p, sizeof(*len));
+    return _image_read(reader, *len);
+}
+
+static int _image_reloc_cmp(const void* a, const void* b)
+{
+    uint64_t x = ((const image_reloc_t*)a)->page.addr;
+    uint64_t y = ((const image_reloc_t*)b)->page.addr;
+    return x < y ? -1 : x > y;
+}
+
+// the reloc of the page obj points into, or NULL if the image doesn't have it.
+static image_reloc_t* _image_find(image_map_t* map, obj_t* obj)
+{
+    uint64_t old_segment = (uintptr_t)obj & ~(uintptr_t)(SEGMENT_SIZE - 1);
+    int lo = 0, hi = map->num_segments - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (map->segments[mid].addr == old_segment)
+            return map->segments[mid].pages[((uintptr_t)obj & (SEGMENT_SIZE - 1)) >> PAGE_SHIFT];
+        else if (map->segments[mid].addr < old_segment)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+// sorts the relocs and builds the segment tables.  Returns 0 if two pages
+// had the same address.
+static int _image_map_init(image_map_t* map, image_reloc_t* relocs, int num_relocs)
+{
+    int i, num_segments = 0;
+    qsort(relocs, num_relocs, sizeof(image_reloc_t), _image_reloc_cmp);
+    for (i = 0; i < num_relocs; i++)
+        if (i == 0 || (relocs[i].page.addr ^ relocs[i - 1].page.addr) >= SEGMENT_SIZE)
+            num_segments++;
+    map->relocs = relocs;
+    map->num_relocs = num_relocs;
+    map->num_segments = 0;
+    map->segments = (image_segment_t*)malloc(sizeof(image_segment_t) * (num_segments + 1));
+    assert(map->segments);
+    image_segment_t* segment = NULL;
+    for (i = 0; i < num_relocs; i++) {
+        uint64_t addr = relocs[i].page.addr;
+        if (i > 0 && addr == relocs[i - 1].page.addr)
+            return 0;
+        if (!segment || segment->addr != (addr & ~(uint64_t)(SEGMENT_SIZE - 1))) {
+            segment = map->segments + map->num_segments++;
+            segment->addr = addr & ~(uint64_t)(SEGMENT_SIZE - 1);
+            memset(segment->pages, 0, sizeof(segment->pages));
+        }
+        segment->pages[(addr & (SEGMENT_SIZE - 1)) >> PAGE_SHIFT] = relocs + i;
+    }
+    return 1;
+}
+
+// if the page's size class is one of ours and only the first granule of
+// a cell is ever marked, like a gc leaves it.
+static int _image_check_marks(image_page_t* image_page)
+{
+    if (image_page->size_class >= NUM_SIZE_CLASSES)
+        return 0;
+    int cell_size = g_size_classes[image_page->size_class].cell_size;
+    uint64_t starts[GRANULES_PER_PAGE / 64];
+    int i, j;
+    memset(starts, 0, sizeof(starts));
+    for (j = 0; j + cell_size <= PAGE_SIZE; j += cell_size)
+        starts[j >> (GRANULE_SHIFT + 6)] |= (uint64_t)1 << ((j >> GRANULE_SHIFT) & 63);
+    for (i = 0; i < GRANULES_PER_PAGE / 64; i++)
+        if (image_page->mark_bits[i] & ~starts[i])
+            return 0;
+    return 1;
+}
+
+// if obj is an immediate or a live cell in one of the image's pages, of the
+// given type unless that's GARBAGE_OBJ.  The map still points into the file,
+// and their marks have been checked, so a marked granule starts a cell.
+static int _image_check(image_map_t* map, obj_t* obj, enum obj_type type)
+{
+    if (!obj)
+        return 0;
+    if (obj_is_immediate(obj))
+        return type == GARBAGE_OBJ;
+    image_reloc_t* reloc = _image_find(map, obj);
+    if (!reloc)
+        return 0;
+    int granule = (int)((uintptr_t)obj - reloc->page.addr) >> GRANULE_SHIFT;
+    return (type == GARBAGE_OBJ || g_size_classes[reloc->page.size_class].type == type) &&
+        ((uintptr_t)obj & ((1 << GRANULE_SHIFT) - 1)) == 0 &&
+        ((reloc->page.mark_bits[granule >> 6] >> (granule & 63)) & 1);
+}
+
+// an env's parent or a closure's env.
+static int _image_check_env(image_map_t* map, obj_t* env)
+{
+    return env == KNULL || _image_check(map, env, ENV_OBJ) ||
+        _image_check(map, env, FRAME_OBJ);
+}
+
+// copies the pair obj points at out of the file, if it is a live pair.
+static int _image_read_pair(image_map_t* map, obj_t* obj, pair_t* pair)
+{
+    if (!_image_check(map, obj, PAIR_OBJ))
+        return 0;
+    image_reloc_t* reloc = _image_find(map, obj);
+    memcpy(pair, reloc->new_page + sizeof(image_page_t) + ((uintptr_t)obj - reloc->page.addr), sizeof(*pair));
+    return 1;
+}
+
+// if plist is a list of (symbol . value) pairs, like env lookups expect.
+static int _image_check_plist(image_map_t* map, obj_t* plist)
+{
+    size_t max_len = (size_t)map->num_relocs * GRANULES_PER_PAGE;  // longer has a cycle
+    size_t i;
+    pair_t pair, binding;
+    for (i = 0; plist != KNULL; i++, plist = pair.cdr) {
+        if (i == max_len || !_image_read_pair(map, plist, &pair) ||
+            !_image_read_pair(map, pair.car, &binding) ||
+            !_image_check(map, binding.car, SYMBOL_OBJ))
+            return 0;
+    }
+    return 1;
+}
+
+// checks what the live cells of a page in the file point at, and that their
+// symbol ids and prim and code indices are in range.
+static int _image_check_page(image_map_t* map, image_reloc_t* reloc, int num_symbols,
+                             int* prims, int num_prims, const char** codes, int num_codes)
+{
+    size_class_t* size_class = g_size_classes + reloc->page.size_class;
+    uint64_t data[PAGE_SIZE / sizeof(uint64_t)];
+    memcpy(data, reloc->new_page + sizeof(image_page_t), PAGE_SIZE);
+    int ok = 1;
+    int j, k;
+    for (j = 0; ok && j + size_class->cell_size <= PAGE_SIZE; j += size_class->cell_size) {
+        int granule = j >> GRANULE_SHIFT;
+        if (!((reloc->page.mark_bits[granule >> 6] >> (granule & 63)) & 1))
+            continue;
+        obj_t* obj = (obj_t*)((char*)data + j);
+        switch (size_class->type) {
+        case SYMBOL_OBJ:
+            ok = obj->data.symbol >= 0 && obj->data.symbol < num_symbols;
+            break;
+        case PAIR_OBJ:
+            ok = _image_check(map, obj->data.pair.car, GARBAGE_OBJ) &&
+                _image_check(map, obj->data.pair.cdr, GARBAGE_OBJ);
+            break;
+        case ENV_OBJ:
+            ok = _image_check_plist(map, obj->data.env.plist) &&
+                _image_check_env(map, obj->data.env.parent);
+            break;
+        case FRAME_OBJ:
+            ok = _image_check_plist(map, obj->data.frame.plist) &&
+                _image_check_env(map, obj->data.frame.parent) &&
+                _image_check(map, obj->data.frame.names, GARBAGE_OBJ);
+            for (k = 0; ok && k < (size_class->cell_size - (int)sizeof(frame_t)) / (int)sizeof(obj_t*); k++)
+                ok = _image_check(map, obj->data.frame.slots[k], GARBAGE_OBJ);
+            break;
+        case COMP_PROC_OBJ:
+            ok = _image_check(map, obj->data.comp_proc.formals, GARBAGE_OBJ) &&
+                _image_check_env(map, obj->data.comp_proc.env) &&
+                _image_check(map, obj->data.comp_proc.body, CODE_OBJ);
+            break;
+        case CODE_OBJ:
+        {
+            intptr_t index = (intptr_t)obj->data.code.bytecode;
+            ok = index >= 0 && index < num_codes &&
+                _image_check(map, obj->data.code.source, GARBAGE_OBJ);
+            bytecode_t head;
+            if (ok)
+                memcpy(&head, codes[index], sizeof(head));
+            for (k = 0; ok && k < head.num_consts; k++) {
+                obj_t* value;
+                memcpy(&value, codes[index] + offsetof(bytecode_t, consts) + k * sizeof(obj_t*), sizeof(value));
+                ok = _image_check(map, value, GARBAGE_OBJ);
+            }
+            break;
+        }
+        case PRIM_FORM_OBJ:
+        {
+            intptr_t index = (intptr_t)obj->data.form_func;
+            ok = index >= 0 && index < num_prims && prim_form(prims[index]);
+            break;
+        }
+        case PRIM_PROC_OBJ:
+        {
+            intptr_t index = (intptr_t)obj->data.prim_proc.func;
+            ok = index >= 0 && index < num_prims && prim_func(prims[index]);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return ok;
+}
+
+// every pointer was checked by _image_check() before anything was copied in.
+static obj_t* _image_relocate(image_map_t* map, obj_t* obj)
+{
+    if (obj_is_immediate(obj))
+        return obj;
+    image_reloc_t* reloc = _image_find(map, obj);
+    assert(reloc);
+    return (obj_t*)(reloc->new_page + ((uintptr_t)obj - reloc->page.addr));
+}
+
+int obj_init_from_image(const char* filename)
+{
+    assert(sizeof(obj_t*) == sizeof(uint64_t));  // NaN-boxing needs 64 bit pointers
+    assert(symbol_count() == 0);  // symbols must get the ids they had
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(image_header_t)) {
+        close(fd);
+        return 0;
+    }
+    char* map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    // check the whole image before setting anything up, so the caller can
+    // still fall back on obj_init().
+    image_reader_t reader = {map, map + st.st_size};
+    image_header_t header;
+    memcpy(&header, _image_read(&reader, sizeof(header)), sizeof(header));
+    int ok = header.magic == IMAGE_MAGIC && header.page_size == PAGE_SIZE;
+    // each one takes at least 4 bytes of the file, so a corrupt count can't
+    // get a huge table malloc'd.
+    size_t max_count = (size_t)st.st_size / sizeof(uint32_t);
+    ok = ok && header.num_symbols <= max_count && header.num_prims <= max_count &&
+        header.num_codes <= max_count && header.num_pages <= max_count;
+    if (!ok) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    const char* symbol_names = reader.p;
+    uint32_t len;
+    int i, j;
+    for (i = 0; ok && i < (int)header.num_symbols; i++)
+        ok = _image_read_string(&reader, &len) != NULL;
+    int* prims = (int*)malloc(sizeof(int) * (header.num_prims + 1));  // image index to ours
+    assert(prims);
+    for (i = 0; ok && i < (int)header.num_prims; i++) {
+        const char* name = _image_read_string(&reader, &len);
+        prims[i] = -1;
+        for (j = 0; name && j < prim_count(); j++)
+            if (strlen(prim_name(j)) == len && memcmp(prim_name(j), name, len) == 0)
+                prims[i] = j;
+        ok = prims[i] >= 0;
+    }
+    const char* symbol_objs = ok ? _image_read(&reader, sizeof(uint64_t) * header.num_symbols) : NULL;
+    const char* pages = ok ? _image_read(&reader, (sizeof(image_page_t) + PAGE_SIZE) * (size_t)header.num_pages) : NULL;
+    for (i = 0; pages && i < (int)header.num_pages; i++) {
+        image_page_t image_page;
+        memcpy(&image_page, pages + (sizeof(image_page_t) + PAGE_SIZE) * i, sizeof(image_page));
+        if (!_image_check_marks(&image_page))
+            pages = NULL;
+    }
+    const char** codes = (const char**)malloc(sizeof(char*) * (header.num_codes + 1));
+    assert(codes);
+    for (i = 0; pages && i < (int)header.num_codes; i++) {
+        uint32_t size = 0;
+        const char* p = _image_read(&reader, sizeof(size));
+        if (p)
+            memcpy(&size, p, sizeof(size));
+        codes[i] = p && size >= sizeof(bytecode_t) ? _image_read(&reader, size) : NULL;
+        bytecode_t head;
+        if (codes[i])
+            memcpy(&head, codes[i], sizeof(head));
+        if (!codes[i] || BYTECODE_ALLOC_SIZE(&head) != size)
+            pages = NULL;
+    }
+
+    // every pointer has to be to a live cell of a page in the image.
+    image_reloc_t* relocs = (image_reloc_t*)malloc(sizeof(image_reloc_t) * (header.num_pages + 1));
+    assert(relocs);
+    int n = header.num_pages;
+    image_map_t lookup;
+    lookup.segments = NULL;
+    for (i = 0; pages && i < n; i++) {
+        relocs[i].new_page = (char*)pages + (sizeof(image_page_t) + PAGE_SIZE) * i;
+        memcpy(&relocs[i].page, relocs[i].new_page, sizeof(image_page_t));
+    }
+    if (pages && !_image_map_init(&lookup, relocs, n))
+        pages = NULL;
+    for (i = 0; pages && i < n; i++)
+        if (!_image_check_page(&lookup, relocs + i, header.num_symbols,
+                               prims, header.num_prims, codes, header.num_codes))
+            pages = NULL;
+    for (i = 0; pages && i < (int)header.num_symbols; i++) {
+        uint64_t addr;
+        memcpy(&addr, symbol_objs + i * sizeof(addr), sizeof(addr));
+        if (addr && !_image_check(&lookup, (obj_t*)addr, SYMBOL_OBJ))
+            pages = NULL;
+    }
+    if (pages && !_image_check(&lookup, (obj_t*)header.env, ENV_OBJ))
+        pages = NULL;
+
+    if (!symbol_objs || !pages || reader.p != reader.end) {
+        free(lookup.segments);
+        free(relocs);
+        free(prims);
+        free(codes);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    _c_stack_init();
+    _heap_init();
+    _mark_init();
+    _fork_init();
+    vm_init();
+
+    reader.p = symbol_names;
+    for (i = 0; i < (int)header.num_symbols; i++) {
+        const char* name = _image_read_string(&reader, &len);
+        int id = symbol_add(name, len);
+        assert(id == i);
+    }
+
+    // copy the pages in, with their marks, as if a major gc had just run.
+    for (i = 0; i < n; i++) {
+        image_page_t* image_page = &relocs[i].page;
+        page_t* page = _page_alloc((int)image_page->size_class);
+        if (!page && _heap_grow(_heap_size() + SEGMENT_SIZE))
+            page = _page_alloc((int)image_page->size_class);
+        if (!page) {
+            fprintf(stderr, "ERROR: out of memory, heap is %zu bytes\n", _heap_size());
+            abort();
+        }
+        char* start = _page_start(page);
+        memcpy(start, relocs[i].new_page + sizeof(image_page_t), PAGE_SIZE);
+        segment_t* segment = _segment_of(page);
+        memcpy(segment->mark_bits + (page - segment->pages) * (GRANULES_PER_PAGE / 64), image_page->mark_bits, sizeof(image_page->mark_bits));
+        page->num_marked = 0;
+        for (j = 0; j < GRANULES_PER_PAGE / 64; j++)
+            page->num_marked += __builtin_popcountll(image_page->mark_bits[j]);
+        page->young = 0;
+        // dead cells are saved zeroed, but a corrupt file could have a
+        // bytecode pointer in one that sweeping would free.
+        for (j = 0; j + page->cell_size <= PAGE_SIZE; j += page->cell_size)
+            if (!_is_marked((obj_t*)(start + j)))
+                memset(start + j, 0, page->cell_size);
+        relocs[i].new_page = start;
+    }
+
+    for (i = 0; i < n; i++) {
+        char* start = relocs[i].new_page;
+        page_t* page = _page_of((obj_t*)start);
+        for (j = 0; j + page->cell_size <= PAGE_SIZE; j += page->cell_size) {
+            obj_t* obj = (obj_t*)(start + j);
+            if (!_is_marked(obj))
+                continue;
+            switch (page->type) {
+            case PAIR_OBJ:
+                obj->data.pair.car = _image_relocate(&lookup, obj->data.pair.car);
+                obj->data.pair.cdr = _image_relocate(&lookup, obj->data.pair.cdr);
+                break;
+            case ENV_OBJ:
+                obj->data.env.plist = _image_relocate(&lookup, obj->data.env.plist);
+                obj->data.env.parent = _image_relocate(&lookup, obj->data.env.parent);
+                break;
+            case FRAME_OBJ:
+            {
+                int k, num_slots = _frame_num_slots(obj);
+                obj->data.frame.plist = _image_relocate(&lookup, obj->data.frame.plist);
+                obj->data.frame.parent = _image_relocate(&lookup, obj->data.frame.parent);
+                obj->data.frame.names = _image_relocate(&lookup, obj->data.frame.names);
+                for (k = 0; k < num_slots; k++)
+                    obj->data.frame.slots[k] = _image_relocate(&lookup, obj->data.frame.slots[k]);
+                break;
+            }
+            case COMP_PROC_OBJ:
+                obj->data.comp_proc.formals = _image_relocate(&lookup, obj->data.comp_proc.formals);
+                obj->data.comp_proc.env = _image_relocate(&lookup, obj->data.comp_proc.env);
+                obj->data.comp_proc.body = _image_relocate(&lookup, obj->data.comp_proc.body);
+                obj->data.comp_proc.serial = ++g_comp_proc_serial;
+                break;
+            case CODE_OBJ:
+            {
+                const char* image_bytecode = codes[(intptr_t)obj->data.code.bytecode];
+                bytecode_t head;
+                memcpy(&head, image_bytecode, sizeof(head));
+                bytecode_t* bytecode = (bytecode_t*)malloc(BYTECODE_ALLOC_SIZE(&head));
+                assert(bytecode);
+                memcpy(bytecode, image_bytecode, BYTECODE_ALLOC_SIZE(&head));
+                int k;
+                for (k = 0; k < bytecode->num_consts; k++)
+                    bytecode->consts[k] = _image_relocate(&lookup, bytecode->consts[k]);
+                bytecode->calls = 0;
+                bytecode->jit = NULL;
+                memset(BYTECODE_CACHES(bytecode), 0, sizeof(ref_cache_t) * bytecode->num_caches);
+                obj->data.code.source = _image_relocate(&lookup, obj->data.code.source);
+                obj->data.code.bytecode = bytecode;
+                break;
+            }
+            case PRIM_FORM_OBJ:
+                obj->data.form_func = prim_form(prims[(intptr_t)obj->data.form_func]);
+                break;
+            case PRIM_PROC_OBJ:
+            {
+                int index = prims[(intptr_t)obj->data.prim_proc.func];
+                obj->data.prim_proc.func = prim_func(index);
+                obj->data.prim_proc.func1 = prim_func1(index);
+                obj->data.prim_proc.func2 = prim_func2(index);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    g_symbol_objs_capacity = 256;
+    while (g_symbol_objs_capacity < (int)header.num_symbols)
+        g_symbol_objs_capacity *= 2;
+    g_symbol_objs = (obj_t**)calloc(g_symbol_objs_capacity, sizeof(obj_t*));
+    assert(g_symbol_objs);
+    for (i = 0; i < (int)header.num_symbols; i++) {
+        uint64_t addr;
+        memcpy(&addr, symbol_objs + i * sizeof(addr), sizeof(addr));
+        if (addr)
+            g_symbol_objs[i] = _image_relocate(&lookup, (obj_t*)addr);
+    }
+    g_env = _image_relocate(&lookup, (obj_t*)header.env);
+    _global_cells_rebuild();
+
+    // symbols defined into frames' plists before the image was saved.
+    for (i = 0; i < n; i++) {
+        char* start = relocs[i].new_page;
+        page_t* page = _page_of((obj_t*)start);
+        if (page->type != FRAME_OBJ)
+            continue;
+        for (j = 0; j + page->cell_size <= PAGE_SIZE; j += page->cell_size) {
+            obj_t* frame = (obj_t*)(start + j);
+            if (!_is_marked(frame))
+                continue;
+            obj_t* plist;
+            for (plist = frame->data.frame.plist; obj_is_pair(plist); plist = obj_cdr(plist))
+                _global_cell_info(obj_car(obj_car(plist)))->in_frame_plist = 1;
+        }
+    }
+
+    free(lookup.segments);
+    free(relocs);
+    free(prims);
+    free(codes);
+    munmap(map, st.st_size);
+
+    _gc_finish(1);
+    g_gc_stats.live_objs = g_num_used_objs;
+    prim_init_symbols();
+    return 1;
+}
+
+//
+// forking
+//
+// Forked children share the parent's heap copy on write, so a page stays
+// shared until someone writes to it.  Marks, remembered bits and the page
+// descriptors are all in the segment headers, a gc never writes to an obj.
+// What's left is sweeping, which threads free lists thru the dead cells, and
+// allocation, which fills them.  So obj_prepare_fork() compacts the heap,
+// sweeps every page, then drops the free lists.  Children allocate from fresh
+// pages only, at least until their first major gc frees something in a shared
+// page.
+//
+// Only the forking thread exists in the child.  The locks are held across
+// the fork so no other thread has them, and the child starts its gc threads
+// over.
+//
+
+void obj_prepare_fork()
+{
+    obj_compact();
+    _sweeper_pause();
+
+    int i;
+    for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+        size_class_t* size_class = g_size_classes + i;
+        while (size_class->sweep_cursor < size_class->sweep_end)
+            _page_try_sweep(g_sweep_queue[size_class->sweep_cursor++]);
+        size_class->pages = NULL;
+        size_class->swept_pages = NULL;
+        size_class->bump = NULL;
+        size_class->bump_end = NULL;
+    }
+    g_sweeper_cursor = g_sweep_queue_size;
+
+    // a minor gc puts swept pages that have free cells back on their size
+    // class, so those are forgotten too.  A major gc sweeps them again.
+    segment_t* segment;
+    for (segment = g_segments; segment; segment = segment->next)
+        for (i = SEGMENT_HEADER_PAGES; i < PAGES_PER_SEGMENT; i++)
+            if (segment->pages[i].type != GARBAGE_OBJ)
+                segment->pages[i].free_cells = NULL;
+
+    _sweeper_resume();
+}
+
+// the sweeper can't be in the middle of a page, the child would get half a free list.
+static void _fork_prepare()
+{
+    pthread_mutex_lock(&g_mark_lock);
+    pthread_mutex_lock(&g_sweep_lock);
+    while (g_sweeper_busy)
+        pthread_cond_wait(&g_sweep_cond, &g_sweep_lock);
+}
+
+static void _fork_parent()
+{
+    pthread_mutex_unlock(&g_sweep_lock);
+    pthread_mutex_unlock(&g_mark_lock);
+}
+
+static void _fork_child()
+{
+    pthread_mutex_unlock(&g_sweep_lock);
+    pthread_mutex_unlock(&g_mark_lock);
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    g_sweep_cond = cond;
+    g_mark_start_cond = cond;
+    g_mark_done_cond = cond;
+    g_num_mark_workers_started = 0;
+    g_sweeper_started = 0;
+    if (!g_sweeper_paused)
+        _sweeper_resume();  // goes over the queue again, swept pages are skipped
+}
+
+static void _fork_init()
+{
+    static int registered = 0;
+    if (!registered)
+        pthread_atfork(_fork_prepare, _fork_parent, _fork_child);
+    registered = 1;
 }
 
 //
@@ -705,10 +2864,13 @@ obj_t* obj_eval_str(const char* str, obj_t* env)
 
 void obj_init()
 {
-    assert(sizeof(obj_t) == 64);
+    assert(sizeof(obj_t*) == sizeof(uint64_t));  // NaN-boxing needs 64 bit pointers
 
-    _stack_init();
-    _pool_init();
+    _c_stack_init();
+    _heap_init();
+    _mark_init();
+    _fork_init();
+    vm_init();
     g_env = obj_make_environment(KNULL, KNULL);
     prim_init();
 
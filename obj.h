@@ -1,6 +1,11 @@
 #ifndef OBJ_H
 #define OBJ_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <setjmp.h>
+
 struct obj_struct;
 
 typedef struct {
@@ -13,18 +18,88 @@ typedef struct env_struct {
     struct obj_struct* parent;
 } env_t;
 
-typedef struct obj_struct* (*prim_func_t)(struct obj_struct* args, struct obj_struct* env);
+// the env of a comp_proc call.  Its locals are in slots, in the order of
+// names, and other bindings can go in its plist like in any env, see
+// compile.h.  It takes the smallest cell the slots fit in.
+typedef struct {
+    struct obj_struct* plist;
+    struct obj_struct* parent;
+    struct obj_struct* names;
+    struct obj_struct* slots[];
+} frame_t;
+
+#define FRAME_MAX_SLOTS 61
+
+// a prim proc gets its evaluated args in argv, which points into the vm's
+// stack, see vm.h.  A prim form gets the list of its args unevaluated.
+typedef struct obj_struct* (*prim_func_t)(int argc, struct obj_struct** argv, struct obj_struct* env);
+typedef struct obj_struct* (*form_func_t)(struct obj_struct* args, struct obj_struct* env);
+
+// a prim proc can also have entry points for exactly 1 and 2 args, which the
+// vm calls instead when the arg count fits, so those skip the argc checks and
+// the loops over argv.  NULL if it doesn't.
+typedef struct obj_struct* (*prim_func1_t)(struct obj_struct* a);
+typedef struct obj_struct* (*prim_func2_t)(struct obj_struct* a, struct obj_struct* b);
+
+typedef struct {
+    prim_func_t func;
+    prim_func1_t func1;
+    prim_func2_t func2;
+} prim_proc_t;
 
 typedef struct {
     struct obj_struct* formals;
     struct obj_struct* env;
-    struct obj_struct* body;
+    struct obj_struct* body;  // code, see compile.h
+    uint64_t serial;          // no two procs get the same one, even at the same address
 } comp_proc_t;
 
-enum obj_type { SYMBOL_OBJ = 0, NUMBER_OBJ, PAIR_OBJ, ENV_OBJ,
-                PRIM_FORM_OBJ, PRIM_PROC_OBJ, COMP_PROC_OBJ, GARBAGE_OBJ };
+// compiled code, see compile.h and vm.h.  The constants and ops are in one
+// malloc'd block owned by the code obj, it's freed when the obj is swept.
+typedef struct bytecode_struct {
+    int size;        // of the ops, in bytes
+    int num_consts;
+    int max_stack;   // most vm stack slots the code pushes
+    int calls;       // counted up to the jit threshold, see jit.h
+    int num_args;    // the formals, which are the first of the locals
+    int num_locals;  // slots in the frame of a call
+    int names;       // consts[names] is the list of the locals' names
+    int num_caches;  // one per OP_REF
+    struct jit_struct* jit;  // NULL until then
+    struct obj_struct* consts[];  // followed by the caches, then the ops
+} bytecode_t;
 
-// the last 5 bits are used to indicate immediate values.
+// where an OP_REF last found its symbol's value, see vm.c.
+typedef struct {
+    struct obj_struct** cell;
+    unsigned int epoch;        // g_env_cells_epoch when it was looked up, 0 until then
+} ref_cache_t;
+
+#define BYTECODE_CACHES(BC) ((ref_cache_t*)((BC)->consts + (BC)->num_consts))
+#define BYTECODE_OPS(BC) ((unsigned char*)(BYTECODE_CACHES(BC) + (BC)->num_caches))
+#define BYTECODE_ALLOC_SIZE(BC) (sizeof(bytecode_t) + sizeof(struct obj_struct*) * (BC)->num_consts + \
+                                 sizeof(ref_cache_t) * (BC)->num_caches + (BC)->size)
+
+typedef struct {
+    struct obj_struct* source;  // the expr it was compiled from
+    bytecode_t* bytecode;
+} code_t;
+
+enum obj_type { SYMBOL_OBJ = 0, PAIR_OBJ, ENV_OBJ,
+                PRIM_FORM_OBJ, PRIM_PROC_OBJ, COMP_PROC_OBJ, CODE_OBJ, FRAME_OBJ, GARBAGE_OBJ };
+
+// obj_t* is a NaN-boxed 64 bit word, the top 16 bits select the kind of value.
+//
+//   0000:pppp:pppp:ppp0  pointer to a heap obj.
+//   0000:0000:0000:00tt  immediate constant, IMM_TAG is set, see tags below.
+//   0001 - fffe:xxxx...  number, a double with NUMBER_OFFSET added to its bits.
+//
+// NaNs are canonicalized before boxing, so adding NUMBER_OFFSET can never
+// wrap a double around into the pointer range.
+#define NUMBER_OFFSET ((uint64_t)1 << 48)
+#define NUMBER_MASK ((uint64_t)0xffff << 48)
+
+// the last 5 bits are used to indicate immediate constants.
 enum obj_immedate_tags { IMM_TAG = 1, TRUE_TAG = 2,
                          FALSE_TAG = 4, NULL_TAG = 8,
                          UNUSED1_TAG = 16, UNUSED2_TAG = 32, TAG_MASK = 63 };
@@ -34,82 +109,140 @@ enum obj_immedate_tags { IMM_TAG = 1, TRUE_TAG = 2,
 #define KFALSE ((obj_t*)(FALSE_TAG | IMM_TAG))
 #define KNULL ((obj_t*)(NULL_TAG | IMM_TAG))
 
+// objs have no header, the type lives in the descriptor of the heap page
+// holding the obj.  So a pair or a code obj takes 16 bytes, a comp_proc or a prim proc 32,
+// a frame 32 to 512 depending on its slots.
 typedef struct obj_struct {
     union {
         int symbol;
-        double number;
         pair_t pair;
         env_t env;
-        prim_func_t prim_func;
+        frame_t frame;
+        prim_proc_t prim_proc;
+        form_func_t form_func;
         comp_proc_t comp_proc;
-    } data;                          // +  0
-    struct obj_struct* next;         // + 24
-    struct obj_struct* prev;         // + 32
-    enum obj_type type;              // + 40
-    int mark;                        // + 44
-    char padding[16];                // + 48
-} obj_t;                      // sizeof = 64
-
-extern int g_num_free_objs;
+        code_t code;
+    } data;
+} obj_t;
+
+extern int g_num_free_pages;
 extern int g_num_used_objs;
 extern obj_t* g_env;
 
-void obj_gc();
-
-// stack which prevents gc from collecting intermediate results.
-void obj_stack_frame_push();
-void obj_stack_frame_pop();
-obj_t* obj_stack_push(obj_t* obj);
-obj_t* obj_stack_get(int i);
-void obj_stack_set(int i, obj_t* obj);
-void obj_stack_dump(const char* desc);  // TODO: REMOVE for debugging
-
-#define PUSHF obj_stack_frame_push
-#define PUSH(OBJ) obj_stack_push(OBJ)
-#define PUSH2(OBJ1, OBJ2)                       \
-    do {                                        \
-        obj_stack_push(OBJ1);                   \
-        obj_stack_push(OBJ2);                   \
-    } while (0)
-
-#define PUSH3(OBJ1, OBJ2, OBJ3)                 \
-    do {                                        \
-        obj_stack_push(OBJ1);                   \
-        obj_stack_push(OBJ2);                   \
-        obj_stack_push(OBJ3);                   \
-    } while (0)
-
-#define PUSH4(OBJ1, OBJ2, OBJ3, OBJ4)           \
-    do {                                        \
-        obj_stack_push(OBJ1);                   \
-        obj_stack_push(OBJ2);                   \
-        obj_stack_push(OBJ3);                   \
-        obj_stack_push(OBJ4);                   \
-    } while (0)
-
-#define POPF_RET(OBJ)                           \
-    do {                                        \
-        obj_t* __ret = OBJ;                     \
-        assert(!obj_is_garbage(__ret));         \
-        obj_stack_frame_pop();                  \
-        assert(!obj_is_garbage(__ret));         \
-        return __ret;                           \
-    } while (0)
-
-#define POPF obj_stack_frame_pop
+// bumped when bindings move, by a compaction or an image load, and when a
+// define adds a binding that might hide one obj_env_cache_cell() handed out.
+// Where a binding's value is kept is good as long as this doesn't change.
+// Starts at 1.
+extern unsigned int g_env_cells_epoch;
+
+void obj_gc();  // full gc, of the young and old generations
+
+// counters since obj_init().  A pause is the time the mutator was stopped for
+// a gc, a mark slice or a compaction.  Survivors are the objs a gc found live,
+// for a minor gc just the young ones.
+typedef struct {
+    int num_minor_gcs;
+    int num_major_gcs;
+    int num_compactions;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t objs_allocated[GARBAGE_OBJ];  // indexed by obj type
+    uint64_t bytes_allocated[GARBAGE_OBJ];
+    int last_survivors;
+    uint64_t total_survivors;
+    int live_objs;  // as of now, live objs plus those allocated since the last gc
+    size_t heap_size;
+    int free_pages;
+    size_t max_c_stack_bytes;  // deepest the evaluator has been
+    int max_vm_stack_objs;     // and the vm
+} obj_gc_stats_t;
+
+void obj_get_gc_stats(obj_gc_stats_t* stats);
+
+// prints a line to stderr after every gc.  off by default.
+void obj_set_gc_log(int enabled);
+
+// full gc that also moves every obj but symbols into fresh pages, in the
+// order they're reachable from the roots.  Objs the C stack points at are
+// pinned and stay put, so C variables stay valid, but objs held anywhere
+// else outside the heap but g_env will be left dangling.
+// Returns 0 if the heap couldn't grow enough to copy into, in which case
+// it's just a full gc.
+int obj_compact();
+
+// heap sizing, must be called before obj_init().  The heap starts at
+// initial_size bytes, grows by growth_factor when it fills up and never
+// grows past max_size.  A 0 leaves that setting at its default, 4 megs,
+// 2.0 and 1024 megs.
+void obj_set_heap_size(size_t initial_size, double growth_factor, size_t max_size);
+
+// a minor gc of the young generation runs after this many bytes have been
+// allocated.  defaults to 1 meg.
+void obj_set_nursery_size(size_t size);
+
+// makes major gcs incremental.  Marking is done in slices of at most
+// max_pause_us microseconds, one every slice_allocs allocations.  A
+// max_pause_us of 0, the default, does major gcs all at once.  Can be
+// changed at any time.
+void obj_set_gc_pause(int max_pause_us, int slice_allocs);
+
+// number of threads used to mark, including the calling thread.  defaults to 1.
+void obj_set_gc_threads(int num_threads);
+
+// when enabled a background thread sweeps after each gc, instead of the
+// allocator sweeping pages as it needs them.  off by default.
+void obj_set_concurrent_sweep(int enabled);
+
+// the C stack of the thread that called obj_init() is scanned for roots, so
+// objs in local variables are safe.  Objs held anywhere else, like malloc'd
+// memory, need to be reachable from g_env to keep gc from collecting them.
+
+// errors unwind to the innermost handler, restoring the vm stack to how it
+// was when the handler was pushed.  The handler is popped on the way out.
+//
+//     obj_handler_t handler;
+//     if (OBJ_TRY(&handler)) {
+//         result = obj_eval_str(str, env);
+//         obj_handler_pop(&handler);
+//     } else {
+//         // obj_error() was called, see obj_error_message().
+//     }
+//
+// With no handler, an error prints the message and exits the process.
+typedef struct obj_handler_struct {
+    jmp_buf jmp;
+    struct obj_struct** vm_sp;
+    struct obj_handler_struct* prev;
+} obj_handler_t;
+
+#define OBJ_TRY(HANDLER) (obj_handler_push(HANDLER), setjmp((HANDLER)->jmp) == 0)
+
+void obj_handler_push(obj_handler_t* handler);
+void obj_handler_pop(obj_handler_t* handler);
+void obj_error(const char* format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+const char* obj_error_message();  // of the last error
+
+// errors out if the C stack is close to overflowing, recursive C code like
+// the evaluator should call this on the way down.
+void obj_check_c_stack();
+char* obj_c_stack_limit();  // the lowest address it lets the stack get to
 
 // all of these may trigger a gc.
 obj_t* obj_make_symbol(const char* str);
 obj_t* obj_make_symbol2(const char* start, const char* end);
-obj_t* obj_make_number(double num);
+obj_t* obj_make_number(double num);  // immediate, never triggers a gc.
 obj_t* obj_make_number2(const char* start, const char* end);
 obj_t* obj_make_pair(obj_t* car, obj_t* cdr);
 obj_t* obj_make_environment(obj_t* plist, obj_t* parent);
-obj_t* obj_make_prim_form(prim_func_t prim_func);
-obj_t* obj_make_prim_proc(prim_func_t prim_func);
+obj_t* obj_make_prim_form(form_func_t form_func);
+obj_t* obj_make_prim_proc(prim_func_t func, prim_func1_t func1, prim_func2_t func2);
 obj_t* obj_make_comp_proc(obj_t* formals, obj_t* env, obj_t* body);
+obj_t* obj_make_code(obj_t* source, bytecode_t* bytecode);  // takes ownership of bytecode
+// the first num_args slots are the args, the rest are ().
+obj_t* obj_make_frame(obj_t* parent, obj_t* names, int num_slots, int num_args, obj_t** args);
 
 // obj type predicates
+enum obj_type obj_get_type(obj_t* obj);  // obj must not be immediate
 int obj_is_garbage(obj_t* obj);  // for debugging gc
 int obj_is_immediate(obj_t* obj);
 int obj_is_boolean(obj_t* obj);
@@ -117,11 +250,14 @@ int obj_is_null(obj_t* obj);
 int obj_is_symbol(obj_t* obj);
 int obj_is_number(obj_t* obj);
 int obj_is_pair(obj_t* obj);
-int obj_is_environment(obj_t* obj);
+int obj_is_environment(obj_t* obj);  // an env or a frame
 int obj_is_prim_form(obj_t* obj);
 int obj_is_prim_proc(obj_t* obj);
 int obj_is_comp_proc(obj_t* obj);
 int obj_is_proc(obj_t* obj);
+int obj_is_code(obj_t* obj);
+
+double obj_number(obj_t* obj);
 
 obj_t* obj_cons(obj_t* a, obj_t* b);
 obj_t* obj_car(obj_t* obj);
@@ -134,9 +270,20 @@ void obj_set_cdr(obj_t* obj, obj_t* value);
 int obj_is_eq(obj_t* a, obj_t* b);
 int obj_is_equal(obj_t* a, obj_t* b);
 
-obj_t* obj_env_lookup(obj_t* env, obj_t* symbol);
+obj_t* obj_env_lookup(obj_t* env, obj_t* symbol);  // () if symbol is unbound
+// where symbol's value is kept, a frame slot or the cdr of a plist pair, or
+// NULL if it's unbound.  Only a compaction moves it.
+obj_t** obj_env_find(obj_t* env, obj_t* symbol);
+
+// obj_env_find() for a cache that keeps the cell until g_env_cells_epoch
+// changes.  NULL if symbol is unbound, or has ever been defined into a frame's
+// plist, since frames are made per call and can't be told apart by a cache.
+obj_t** obj_env_cache_cell(obj_t* env, obj_t* symbol);
 
 void obj_env_define(obj_t* env, obj_t* symbol, obj_t* value);
+void obj_frame_set(obj_t* frame, int index, obj_t* value);
+
+void obj_print(obj_t* obj, FILE* fp);
 
 // debug output
 void obj_dump(obj_t* n, int to_stderr);
@@ -147,4 +294,20 @@ obj_t* obj_eval_str(const char* str, obj_t* env); // gc
 // interpreter init, this needs happen before any thing else.
 void obj_init();
 
+// heap images.  obj_save_image() does a full gc, then writes the heap, the
+// symbol table and g_env to a file.  obj_init_from_image() can be called
+// instead of obj_init(), it picks up where the saved process left off without
+// running bootstrap.scm.  Objs only held by C code aren't
+// reachable after loading, and an image only loads into a process that has
+// every prim it refers to.  Both return 0 on failure, a failed load leaves the
+// interpreter uninitialized.
+int obj_save_image(const char* filename);
+int obj_init_from_image(const char* filename);
+
+// call before forking processes that should share the heap copy on write.
+// Compacts the heap and leaves it so children only write to pages of their
+// own, until they do a major gc.  Forking is fine at any time without it, gc
+// threads are restarted in the child either way.
+void obj_prepare_fork();
+
 #endif
@@ -7,11 +7,7 @@
 #include <stdlib.h>
 #include <math.h>
 
-#define PARSE_ERROR(err)                                        \
-    do {                                                        \
-        fprintf(stderr, "%s\n", err);                           \
-        exit(1);                                                \
-    } while(0)
+#define PARSE_ERROR(err) obj_error("%s", err)
 
 #define ADVANCE() *pp = *pp + 1
 #define PEEK(i) *(*pp + i)
@@ -128,19 +124,19 @@ obj_t* parse_list(const char** pp)
     }
     else {
         // EXPR+
-        PUSHF();
-        PUSH4(KNULL, KNULL, KNULL, KNULL);  // root, pair, expr, temp
+        obj_t* root = KNULL;
+        obj_t* pair = KNULL;
         do {
-            obj_stack_set(2, parse_expr(pp));
-            if (obj_is_null(obj_stack_get(1))) {
+            obj_t* expr = parse_expr(pp);
+            if (obj_is_null(pair)) {
                 // first time thru the loop, initialize root.
-                obj_stack_set(0, obj_cons(obj_stack_get(2), KNULL));
-                obj_stack_set(1, obj_stack_get(0));
+                root = obj_cons(expr, KNULL);
+                pair = root;
             } else {
                 // append expr onto end of root list.
-                obj_stack_set(3, obj_stack_get(1));
-                obj_stack_set(1, obj_cons(obj_stack_get(2), KNULL));
-                obj_set_cdr(obj_stack_get(3), obj_stack_get(1));
+                obj_t* temp = obj_cons(expr, KNULL);
+                obj_set_cdr(pair, temp);
+                pair = temp;
             }
             parse_skip_whitespace(pp);
             if (PEEK(0) == '.' || PEEK(0) == ')')
@@ -150,8 +146,7 @@ obj_t* parse_list(const char** pp)
         // (PERIOD EXPR)?
         if (PEEK(0) == '.') {
             ADVANCE();
-            obj_stack_set(2, parse_expr(pp));
-            obj_set_cdr(obj_stack_get(1), obj_stack_get(2));
+            obj_set_cdr(pair, parse_expr(pp));
         }
 
         parse_skip_whitespace(pp);
@@ -160,19 +155,17 @@ obj_t* parse_list(const char** pp)
             PARSE_ERROR("Expected ) after dotted expr");
         ADVANCE();
 
-        POPF_RET(obj_stack_get(0));
+        return root;
     }
 }
 
 obj_t* parse_quote_expr(const char** pp, const char* name)
 {
     ADVANCE();
-    PUSHF();
-    obj_t* expr = PUSH(parse_expr(pp));
-    obj_t* symbol = PUSH(obj_make_symbol(name));
-    obj_t* d = PUSH(obj_cons(expr, KNULL));
-    obj_t* pair = PUSH(obj_cons(symbol, d));
-    POPF_RET(pair);
+    obj_t* expr = parse_expr(pp);
+    obj_t* symbol = obj_make_symbol(name);
+    obj_t* d = obj_cons(expr, KNULL);
+    return obj_cons(symbol, d);
 }
 
 obj_t* parse_expr(const char** pp)
@@ -196,31 +189,38 @@ obj_t* parse_expr(const char** pp)
 obj_t* parse_expr_sequence(const char** pp)
 {
     // EXPR*
-    PUSHF();
-    obj_t* begin = PUSH(obj_make_symbol("begin"));
-    obj_t* pair = PUSH(obj_cons(begin, KNULL));
-    PUSH(KNULL);
+    obj_t* begin = obj_make_symbol("begin");
+    obj_t* root = obj_cons(begin, KNULL);
+    obj_t* pair = root;
     while (1) {
         parse_skip_whitespace(pp);
         if (PEEK(0) == 0)
             break;
-        obj_stack_set(2, parse_expr(pp));
-        obj_set_cdr(pair, obj_cons(obj_stack_get(2), KNULL));
+        obj_t* expr = parse_expr(pp);
+        obj_set_cdr(pair, obj_cons(expr, KNULL));
         pair = obj_cdr(pair);
     }
-    POPF_RET(obj_stack_get(1));
+    return root;
 }
 
-obj_t* read(const char* str)
+obj_t* read_str(const char* str)
 {
     return parse_expr(&str);
 }
 
-obj_t* read_file(const char* filename)
+obj_t* read_next(const char** pp)
+{
+    parse_skip_whitespace(pp);
+    if (PEEK(0) == 0)
+        return NULL;
+    return parse_expr(pp);
+}
+
+char* read_file_str(const char* filename)
 {
     FILE* fp = fopen(filename, "r");
     if (!fp)
-        return KNULL;
+        return NULL;
 
 	fseek(fp, 0, SEEK_END);
 	int file_size = ftell(fp);
@@ -230,6 +230,14 @@ obj_t* read_file(const char* filename)
 	assert(file_size == bytes_read);
 	fclose(fp);
 	str[file_size] = 0;  // make sure it's null terminated.
+    return str;
+}
+
+obj_t* read_file(const char* filename)
+{
+    char* str = read_file_str(filename);
+    if (!str)
+        return KNULL;
     const char* p = str;
     obj_t* result = parse_expr_sequence(&p);
     free(str);
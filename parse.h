@@ -3,7 +3,14 @@
 
 #include "obj.h"
 
-obj_t* read(const char* str);
-obj_t* read_file(const char* filename);
+obj_t* read_str(const char* str);
+obj_t* read_file(const char* filename);  // as a (begin ...) of every expr in it
+
+// reads the expr at *pp and advances past it, returns NULL if only white-space
+// and comments are left.
+obj_t* read_next(const char** pp);
+
+// the whole file, null terminated, or NULL if it can't be opened.  free() it.
+char* read_file_str(const char* filename);
 
 #endif
@@ -1,4 +1,6 @@
 #include "prim.h"
+#include "vm.h"
+#include "compile.h"
 #include "symbol.h"
 #include <stdlib.h>
 #include <assert.h>
@@ -8,53 +10,56 @@
 typedef struct {
     const char* name;
     prim_func_t func;
-    int form;
+    form_func_t form;
+    prim_func1_t func1;
+    prim_func2_t func2;
 } prim_info_t;
 
-#define TRUE 1
-#define FALSE 0
-
-static obj_t* _eval(obj_t* obj, obj_t* env);
+// interned symbols used by the prim forms, symbol objs are never collected.
+static obj_t* s_unquote_symbol = NULL;
 
 static prim_info_t s_prim_infos[] = {
     // forms
-    {"define", form_define, TRUE},
-    {"if", form_if, TRUE},
-    {"quote", form_quote, TRUE},
-    {"quasiquote", form_quasiquote, TRUE},
-    {"set!", form_set, TRUE},
-    {"begin", form_begin, TRUE},
-    {"lambda", form_lambda, TRUE},
+    {"define", NULL, form_define},
+    {"if", NULL, form_if},
+    {"quote", NULL, form_quote},
+    {"quasiquote", NULL, form_quasiquote},
+    {"set!", NULL, form_set},
+    {"begin", NULL, form_begin},
+    {"lambda", NULL, form_lambda},
 
     // procs
-    {"boolean?", proc_is_boolean, FALSE},
-    {"null?", proc_is_null, FALSE},
-    {"symbol?", proc_is_symbol, FALSE},
-    {"number?", proc_is_number, FALSE},
-    {"pair?", proc_is_pair, FALSE},
-    {"environment?", proc_is_environment, FALSE},
-    {"procedure?", proc_is_procedure, FALSE},
-    {"eq?", proc_is_eq, FALSE},
-    {"equal?", proc_is_equal, FALSE},
-    {"cons", proc_cons, FALSE},
-    {"car", proc_car, FALSE},
-    {"cdr", proc_cdr, FALSE},
-    {"set-car!", proc_set_car, FALSE},
-    {"set-cdr!", proc_set_cdr, FALSE},
-    {"+", proc_add, FALSE},
-    {"-", proc_sub, FALSE},
-    {"*", proc_mul, FALSE},
-    {"/", proc_div, FALSE},
-    {">", proc_num_gt, FALSE},
-    {">=", proc_num_gteq, FALSE},
-    {"=", proc_num_eq, FALSE},
-    {"<", proc_num_lt, FALSE},
-    {"<=", proc_num_lteq, FALSE},
-    {"abs", proc_num_abs, FALSE},
-    {"eval", proc_eval, FALSE},
-    {"print", proc_print, FALSE},
-    {"not", proc_not, FALSE},
-    {"make-environment", proc_make_environment, FALSE},
+    {"boolean?", proc_is_boolean, NULL, proc_is_boolean1, NULL},
+    {"null?", proc_is_null, NULL, proc_is_null1, NULL},
+    {"symbol?", proc_is_symbol, NULL, proc_is_symbol1, NULL},
+    {"number?", proc_is_number, NULL, proc_is_number1, NULL},
+    {"pair?", proc_is_pair, NULL, proc_is_pair1, NULL},
+    {"environment?", proc_is_environment, NULL, proc_is_environment1, NULL},
+    {"procedure?", proc_is_procedure, NULL, proc_is_procedure1, NULL},
+    {"eq?", proc_is_eq, NULL, NULL, proc_is_eq2},
+    {"equal?", proc_is_equal, NULL, NULL, proc_is_equal2},
+    {"cons", proc_cons, NULL, NULL, proc_cons2},
+    {"car", proc_car, NULL, proc_car1, NULL},
+    {"cdr", proc_cdr, NULL, proc_cdr1, NULL},
+    {"set-car!", proc_set_car, NULL, NULL, proc_set_car2},
+    {"set-cdr!", proc_set_cdr, NULL, NULL, proc_set_cdr2},
+    {"+", proc_add, NULL, proc_add1, proc_add2},
+    {"-", proc_sub, NULL, proc_sub1, proc_sub2},
+    {"*", proc_mul, NULL, proc_mul1, proc_mul2},
+    {"/", proc_div, NULL, proc_div1, proc_div2},
+    {">", proc_num_gt, NULL, NULL, proc_num_gt2},
+    {">=", proc_num_gteq, NULL, NULL, proc_num_gteq2},
+    {"=", proc_num_eq, NULL, NULL, proc_num_eq2},
+    {"<", proc_num_lt, NULL, NULL, proc_num_lt2},
+    {"<=", proc_num_lteq, NULL, NULL, proc_num_lteq2},
+    {"abs", proc_num_abs, NULL, proc_num_abs1, NULL},
+    {"eval", proc_eval},
+    {"print", proc_print},
+    {"not", proc_not, NULL, proc_not1, NULL},
+    {"make-environment", proc_make_environment},
+    {"gc-stats", proc_gc_stats},
+    {"vm-stack-limit", proc_vm_stack_limit},
+    {"try-eval", proc_try_eval},
 
     {"", NULL}
 };
@@ -63,22 +68,72 @@ void prim_init()
 {
     // register prims
     prim_info_t* p = s_prim_infos;
-    while (p->func) {
-        if (p->form) {
-            PUSHF();
-            obj_t* symbol = PUSH(obj_make_symbol(p->name));
-            obj_t* obj = PUSH(obj_make_prim_form(p->func));
-            obj_env_define(g_env, symbol, obj);
-            POPF();
-        } else {
-            PUSHF();
-            obj_t* symbol = PUSH(obj_make_symbol(p->name));
-            obj_t* obj = PUSH(obj_make_prim_proc(p->func));
-            obj_env_define(g_env, symbol, obj);
-            POPF();
-        }
+    while (p->func || p->form) {
+        obj_t* symbol = obj_make_symbol(p->name);
+        obj_t* obj = p->form ? obj_make_prim_form(p->form) : obj_make_prim_proc(p->func, p->func1, p->func2);
+        obj_env_define(g_env, symbol, obj);
         p++;
     }
+
+    prim_init_symbols();
+}
+
+void prim_init_symbols()
+{
+    s_unquote_symbol = obj_make_symbol("unquote");
+}
+
+int prim_count()
+{
+    return sizeof(s_prim_infos) / sizeof(s_prim_infos[0]) - 1;
+}
+
+const char* prim_name(int index)
+{
+    assert(index >= 0 && index < prim_count());
+    return s_prim_infos[index].name;
+}
+
+prim_func_t prim_func(int index)
+{
+    assert(index >= 0 && index < prim_count());
+    return s_prim_infos[index].func;
+}
+
+prim_func1_t prim_func1(int index)
+{
+    assert(index >= 0 && index < prim_count());
+    return s_prim_infos[index].func1;
+}
+
+prim_func2_t prim_func2(int index)
+{
+    assert(index >= 0 && index < prim_count());
+    return s_prim_infos[index].func2;
+}
+
+form_func_t prim_form(int index)
+{
+    assert(index >= 0 && index < prim_count());
+    return s_prim_infos[index].form;
+}
+
+int prim_index(prim_func_t func)
+{
+    int i;
+    for (i = 0; i < prim_count(); i++)
+        if (s_prim_infos[i].func && s_prim_infos[i].func == func)
+            return i;
+    return -1;
+}
+
+int prim_form_index(form_func_t func)
+{
+    int i;
+    for (i = 0; i < prim_count(); i++)
+        if (s_prim_infos[i].form && s_prim_infos[i].form == func)
+            return i;
+    return -1;
 }
 
 #define ENTRY_ASSERT()                          \
@@ -89,29 +144,30 @@ void prim_init()
 obj_t* form_define(obj_t* obj, obj_t* env)
 {
     ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-
-    obj_t* symbol = PUSH(obj_car(obj));
-    obj_t* value = PUSH(_eval(obj_cadr(obj), env));
+    obj_t* symbol = obj_car(obj);
+    obj_t* value = vm_eval(obj_cadr(obj), env);
     obj_env_define(env, symbol, value);
-    POPF_RET(symbol);
+    return symbol;
 }
 
-obj_t* form_if(obj_t* obj, obj_t* env)
+// evaluates the predicate and returns the branch to take, which is in tail
+// context.  A missing else branch is (), which evaluates to itself.
+static obj_t* _if_tail(obj_t* obj, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-
-    obj_t* pred = PUSH(_eval(obj_car(obj), env));
+    obj_t* pred = vm_eval(obj_car(obj), env);
     if (obj_is_null(pred) || pred == KFALSE)
         if (obj_is_pair(obj_cdr(obj_cdr(obj))))
-            POPF_RET(_eval(obj_car(obj_cdr(obj_cdr(obj))), env));
+            return obj_car(obj_cdr(obj_cdr(obj)));
         else
-            POPF_RET(KNULL);
+            return KNULL;
     else
-        POPF_RET(_eval(obj_cadr(obj), env));
+        return obj_cadr(obj);
+}
+
+obj_t* form_if(obj_t* obj, obj_t* env)
+{
+    ENTRY_ASSERT();
+    return vm_eval(_if_tail(obj, env), env);
 }
 
 obj_t* form_quote(obj_t* obj, obj_t* env)
@@ -124,9 +180,8 @@ static obj_t* _unquoted(obj_t* e, obj_t* env)
 {
     if (obj_is_pair(e)) {
         obj_t* a = obj_car(e);
-        obj_t* unquote = obj_make_symbol("unquote");
-        if (obj_is_symbol(a) && obj_is_eq(a, unquote)) {
-            return _eval(obj_cadr(e), env);
+        if (a == s_unquote_symbol) {
+            return vm_eval(obj_cadr(e), env);
         }
     }
     return e;
@@ -137,92 +192,127 @@ static obj_t* _quasiquote(obj_t* obj, obj_t* env)
     if (!obj_is_pair(obj))
         return obj;
     else {
-        obj_t* a = obj_car(obj);
-        obj_t* e = PUSH(_unquoted(a, env));
-        return PUSH(obj_cons(e, _quasiquote(obj_cdr(obj), env)));
+        obj_t* e = _unquoted(obj_car(obj), env);
+        return obj_cons(e, _quasiquote(obj_cdr(obj), env));
     }
 }
 
 obj_t* form_quasiquote(obj_t* obj, obj_t* env)
 {
     ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
     obj_t* a = obj_car(obj);
     if (obj_is_pair(obj))
-        POPF_RET(_quasiquote(a, env));
+        return _quasiquote(a, env);
     else
-        POPF_RET(a);
+        return a;
 }
 
 obj_t* form_set(obj_t* obj, obj_t* env)
 {
     ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-    obj_t* symbol = PUSH(obj_car(obj));
-    obj_t* new_value = PUSH(_eval(obj_cadr(obj), env));
-    obj_t* old_value = PUSH(obj_env_lookup(env, symbol));
+    obj_t* symbol = obj_car(obj);
+    obj_t* new_value = vm_eval(obj_cadr(obj), env);
+    obj_t* old_value = obj_env_lookup(env, symbol);
     obj_env_define(env, symbol, new_value);
-    POPF_RET(old_value);
+    return old_value;
 }
 
-obj_t* form_begin(obj_t* obj, obj_t* env)
+// evaluates all but the last expr and returns the last, which is in tail
+// context.
+static obj_t* _begin_tail(obj_t* obj, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-    PUSH(KNULL);
-    while (obj_is_pair(obj)) {
-        obj_stack_set(2, _eval(obj_car(obj), env));
+    if (!obj_is_pair(obj))
+        return KNULL;
+    while (obj_is_pair(obj_cdr(obj))) {
+        vm_eval(obj_car(obj), env);
         obj = obj_cdr(obj);
     }
-    POPF_RET(obj_stack_get(2));
+    return obj_car(obj);
+}
+
+obj_t* form_begin(obj_t* obj, obj_t* env)
+{
+    ENTRY_ASSERT();
+    return vm_eval(_begin_tail(obj, env), env);
 }
 
 obj_t* form_lambda(obj_t* obj, obj_t* env)
 {
     ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-    obj_t* static_env = PUSH(obj_make_environment(KNULL, env));
-    POPF_RET(obj_make_comp_proc(obj_car(obj), static_env, obj_cadr(obj)));
+    return obj_make_comp_proc(obj_car(obj), env, compile_lambda(obj_car(obj), obj_cadr(obj), env));
 }
 
+// procs that take n args error out on fewer, extra args are ignored.
+#define PROC_ENTRY(n)                                              \
+    assert(obj_is_environment(env));                               \
+    if (argc < (n))                                                \
+        obj_error("too few args")
+
+// bad args are errors rather than asserts, so a bad request can't take a
+// server down.
+#define CHECK_NUMBER(OBJ)                                          \
+    do {                                                           \
+        if (!obj_is_number(OBJ))                                   \
+            obj_error("not a number");                             \
+    } while (0)
+
+// each DEF_ macro also defines the fixed arity entry points the vm calls when
+// the arg count fits, proc_func1 and/or proc_func2, and the argv one calls
+// those.
 #define DEF_PROC(proc_func, obj_func)                              \
-obj_t* proc_func(obj_t* obj, obj_t* env)                           \
+obj_t* proc_func##1(obj_t* a)                                      \
+{                                                                  \
+    return obj_func(a);                                            \
+}                                                                  \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)               \
 {                                                                  \
-    ENTRY_ASSERT();                                                \
-    return obj_func(obj_car(obj));                                 \
+    PROC_ENTRY(1);                                                 \
+    return proc_func##1(argv[0]);                                  \
 }
 
 #define DEF_PROC2(proc_func, obj_func)                             \
-obj_t* proc_func(obj_t* obj, obj_t* env)                           \
+obj_t* proc_func##2(obj_t* a, obj_t* b)                            \
 {                                                                  \
-    ENTRY_ASSERT();                                                \
-    return obj_func(obj_car(obj), obj_cadr(obj));                  \
+    return obj_func(a, b);                                         \
+}                                                                  \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)               \
+{                                                                  \
+    PROC_ENTRY(2);                                                 \
+    return proc_func##2(argv[0], argv[1]);                         \
 }
 
 #define DEF_BOOL_PROC(proc_func, obj_func)                         \
-obj_t* proc_func(obj_t* obj, obj_t* env)                           \
+obj_t* proc_func##1(obj_t* a)                                      \
+{                                                                  \
+    return obj_func(a) ? KTRUE : KFALSE;                           \
+}                                                                  \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)               \
 {                                                                  \
-    ENTRY_ASSERT();                                                \
-    return obj_func(obj_car(obj)) ? KTRUE : KFALSE;                \
+    PROC_ENTRY(1);                                                 \
+    return proc_func##1(argv[0]);                                  \
 }
 
 #define DEF_BOOL_PROC2(proc_func, obj_func)                        \
-obj_t* proc_func(obj_t* obj, obj_t* env)                           \
+obj_t* proc_func##2(obj_t* a, obj_t* b)                            \
+{                                                                  \
+    return obj_func(a, b) ? KTRUE : KFALSE;                        \
+}                                                                  \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)               \
 {                                                                  \
-    ENTRY_ASSERT();                                                \
-    return obj_func(obj_car(obj), obj_cadr(obj)) ? KTRUE : KFALSE; \
+    PROC_ENTRY(2);                                                 \
+    return proc_func##2(argv[0], argv[1]);                         \
 }
 
 #define DEF_NULL_PROC2(proc_func, obj_func)                        \
-obj_t* proc_func(obj_t* obj, obj_t* env)                           \
+obj_t* proc_func##2(obj_t* a, obj_t* b)                            \
 {                                                                  \
-    ENTRY_ASSERT();                                                \
-    obj_func(obj_car(obj), obj_cadr(obj));                         \
+    obj_func(a, b);                                                \
     return KNULL;                                                  \
+}                                                                  \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)               \
+{                                                                  \
+    PROC_ENTRY(2);                                                 \
+    return proc_func##2(argv[0], argv[1]);                         \
 }
 
 DEF_BOOL_PROC(proc_is_boolean, obj_is_boolean)
@@ -240,75 +330,80 @@ DEF_PROC(proc_cdr, obj_cdr)
 DEF_NULL_PROC2(proc_set_car, obj_set_car)
 DEF_NULL_PROC2(proc_set_cdr, obj_set_cdr)
 
-#define DEF_MATH_PROC(proc_func, op, ident)         \
-obj_t* proc_func(obj_t* obj, obj_t* env)            \
-{                                                   \
-    ENTRY_ASSERT();                                 \
-    PUSHF();                                        \
-    PUSH2(obj, env);                                \
-    PUSH(KNULL);                                    \
-    obj_t* root = obj;                              \
-    double accum = ident;                           \
-    while (obj_is_pair(obj)) {                      \
-        obj_t* arg = obj_car(obj);                  \
-        assert(obj_is_number(arg));                 \
-        if (obj == root)                            \
-            accum = arg->data.number;               \
-        else                                        \
-            accum op arg->data.number;              \
-        obj = obj_cdr(obj);                         \
-    }                                               \
-                                                    \
-    POPF_RET(obj_make_number(accum));               \
+#define DEF_MATH_PROC(proc_func, op, ident)                 \
+obj_t* proc_func##1(obj_t* a)                               \
+{                                                           \
+    CHECK_NUMBER(a);                                        \
+    return a;                                               \
+}                                                           \
+obj_t* proc_func##2(obj_t* a, obj_t* b)                     \
+{                                                           \
+    CHECK_NUMBER(a);                                        \
+    CHECK_NUMBER(b);                                        \
+    double accum = obj_number(a);                           \
+    accum op obj_number(b);                                 \
+    return obj_make_number(accum);                          \
+}                                                           \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)        \
+{                                                           \
+    PROC_ENTRY(0);                                          \
+    if (argc == 0)                                          \
+        return obj_make_number(ident);                      \
+    CHECK_NUMBER(argv[0]);                                  \
+    double accum = obj_number(argv[0]);                     \
+    int i;                                                  \
+    for (i = 1; i < argc; i++) {                            \
+        CHECK_NUMBER(argv[i]);                              \
+        accum op obj_number(argv[i]);                       \
+    }                                                       \
+    return obj_make_number(accum);                          \
 }
 
 DEF_MATH_PROC(proc_add, +=, 0.0)
 DEF_MATH_PROC(proc_mul, *=, 1.0)
 DEF_MATH_PROC(proc_div, /=, 1.0)
 
-obj_t* proc_sub(obj_t* obj, obj_t* env)
+obj_t* proc_sub1(obj_t* a)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-    if (obj_is_null(obj)) {
-        // no args
-        POPF_RET(obj_make_number(0.0));
-    } else if (obj_is_null(obj_cdr(obj))) {
-        // one arg
-        obj_t* arg = obj_car(obj);
-        POPF_RET(obj_make_number(-arg->data.number));
-    } else if (obj_is_pair(obj_cdr(obj))) {
-        // two or more args
-        obj_t* root = obj;
-        double accum = 0.0f;
-        PUSH(KNULL);
-        while (obj_is_pair(obj)){
-            obj_t* arg = obj_car(obj);
-            assert(obj_is_number(arg));
-            if (obj == root)
-                accum = arg->data.number;
-            else
-                accum -= arg->data.number;
-            obj = obj_cdr(obj);
-        }
-        POPF_RET(obj_make_number(accum));
-    } else {
-        assert(0);
-        POPF_RET(obj_make_number(0.0));
+    CHECK_NUMBER(a);
+    return obj_make_number(-obj_number(a));
+}
+
+obj_t* proc_sub2(obj_t* a, obj_t* b)
+{
+    CHECK_NUMBER(a);
+    CHECK_NUMBER(b);
+    return obj_make_number(obj_number(a) - obj_number(b));
+}
+
+obj_t* proc_sub(int argc, obj_t** argv, obj_t* env)
+{
+    PROC_ENTRY(0);
+    if (argc == 0)
+        return obj_make_number(0.0);
+    if (argc == 1)
+        return proc_sub1(argv[0]);
+    CHECK_NUMBER(argv[0]);
+    double accum = obj_number(argv[0]);
+    int i;
+    for (i = 1; i < argc; i++) {
+        CHECK_NUMBER(argv[i]);
+        accum -= obj_number(argv[i]);
     }
-    return KNULL;
+    return obj_make_number(accum);
 }
 
 #define DEF_MATH_CMP_PROC(proc_func, op)                        \
-obj_t* proc_func(obj_t* obj, obj_t* env)                        \
+obj_t* proc_func##2(obj_t* a, obj_t* b)                         \
+{                                                               \
+    CHECK_NUMBER(a);                                            \
+    CHECK_NUMBER(b);                                            \
+    return obj_number(a) op obj_number(b) ? KTRUE : KFALSE;     \
+}                                                               \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)            \
 {                                                               \
-    ENTRY_ASSERT();                                             \
-    obj_t* a = obj_car(obj);                                    \
-    assert(obj_is_number(a));                                   \
-    obj_t* b = obj_cadr(obj);                                   \
-    assert(obj_is_number(b));                                   \
-    return a->data.number op b->data.number ? KTRUE : KFALSE;   \
+    PROC_ENTRY(2);                                              \
+    return proc_func##2(argv[0], argv[1]);                      \
 }
 
 DEF_MATH_CMP_PROC(proc_num_gt, >)
@@ -318,123 +413,127 @@ DEF_MATH_CMP_PROC(proc_num_lt, <)
 DEF_MATH_CMP_PROC(proc_num_lteq, <=)
 
 #define MATH_FUNC(proc_func, obj_func)                          \
-obj_t* proc_func(obj_t* obj, obj_t* env)                        \
+obj_t* proc_func##1(obj_t* a)                                   \
+{                                                               \
+    CHECK_NUMBER(a);                                            \
+    return obj_make_number(obj_func(obj_number(a)));            \
+}                                                               \
+obj_t* proc_func(int argc, obj_t** argv, obj_t* env)            \
 {                                                               \
-    ENTRY_ASSERT();                                             \
-    PUSHF();                                                    \
-    PUSH2(obj, env);                                            \
-    obj_t* a = obj_car(obj);                                    \
-    assert(obj_is_number(a));                                   \
-    POPF_RET(obj_make_number(obj_func(a->data.number)));        \
+    PROC_ENTRY(1);                                              \
+    return proc_func##1(argv[0]);                               \
+}
+
+MATH_FUNC(proc_num_abs, fabs)
+// TODO: sin, cos etc..
+
+obj_t* proc_eval(int argc, obj_t** argv, obj_t* env)
+{
+    PROC_ENTRY(1);
+    if (argc < 2)
+        return vm_eval(argv[0], env);
+    if (!obj_is_environment(argv[1]))
+        obj_error("eval in a non-environment");
+    return vm_eval(argv[0], argv[1]);
 }
 
-// TODO: make this iterative.
-static obj_t* _map_eval(obj_t* obj, obj_t* env)
+obj_t* proc_print(int argc, obj_t** argv, obj_t* env)
 {
-    PUSHF();
-    PUSH2(obj, env); // 0, 1
-    if (obj_is_null(obj)) {
-        POPF_RET(KNULL);
-    }
-    if (obj_is_pair(obj)) {
-        obj_t* a = PUSH(_eval(obj_car(obj), env));
-        POPF_RET(obj_cons(a, _map_eval(obj_cdr(obj), env)));
-    } else {
-        assert(0);
-        POPF_RET(KNULL);
+    PROC_ENTRY(0);
+    int i;
+    for (i = 0; i < argc; i++) {
+        obj_dump(argv[i], 0);
+        printf(" ");
     }
+    printf("\n");
+    return KNULL;
 }
 
-MATH_FUNC(proc_num_abs, fabs)
-// TODO: sin, cos etc..
+obj_t* proc_not1(obj_t* a)
+{
+    return (a == KNULL || a == KFALSE) ? KTRUE : KFALSE;
+}
 
-// TODO: tail call optimization
-static obj_t* _eval(obj_t* obj, obj_t* env)
+obj_t* proc_not(int argc, obj_t** argv, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-
-    if (obj_is_symbol(obj)) {
-        POPF_RET(obj_env_lookup(env, obj));
-    } else if (obj_is_pair(obj)) {
-        obj_t* args = PUSH(obj_cons(obj_car(obj), KNULL));
-        obj_t* f = PUSH(proc_eval(args, env));
-        obj_t* d = PUSH(obj_cdr(obj));
-        switch (f->type) {
-        case PRIM_FORM_OBJ:
-            POPF_RET(f->data.prim_func(d, env));
-        case PRIM_PROC_OBJ:
-        {
-            obj_t* dd = PUSH(_map_eval(d, env));
-            POPF_RET(f->data.prim_func(dd, env));
-            break;
-        }
-        case COMP_PROC_OBJ:
-        {
-            obj_t* dynamic_env = PUSH(obj_make_environment(KNULL, env));
-            obj_t* formals = f->data.comp_proc.formals;
-            obj_t* body = f->data.comp_proc.body;
-            while (obj_is_pair(formals)) {
-                obj_env_define(dynamic_env, obj_car(formals), _eval(obj_car(d), env));
-                formals = obj_cdr(formals);
-                d = obj_cdr(d);
-            }
-            POPF_RET(_eval(body, dynamic_env));
-            break;
-        }
-        default:
-            fprintf(stderr, "ERROR: f is not a procedure or form\n");
-            assert(0);  // bad f
-            POPF_RET(KNULL);
-        }
-    } else {
-        POPF_RET(obj);
-    }
+    PROC_ENTRY(1);
+    return proc_not1(argv[0]);
 }
 
-obj_t* proc_eval(obj_t* obj, obj_t* env)
+obj_t* proc_make_environment(int argc, obj_t** argv, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
+    PROC_ENTRY(0);
+    return obj_make_environment(KNULL, env);
+}
 
-    obj_t* a = obj_car(obj);
-    obj_t* d = obj_cdr(obj);
-    if (obj_is_pair(d))
-        POPF_RET(_eval(a, obj_car(d)));
-    else
-        POPF_RET(_eval(a, env));
+// adds (key . value) to the front of the alist.
+static obj_t* _acons(const char* key, obj_t* value, obj_t* alist)
+{
+    obj_t* symbol = obj_make_symbol(key);
+    return obj_cons(obj_cons(symbol, value), alist);
 }
 
-obj_t* proc_print(obj_t* obj, obj_t* env)
+obj_t* proc_gc_stats(int argc, obj_t** argv, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH(KNULL);
-    while (obj_is_pair(obj)) {
-        obj_stack_set(0, obj_car(obj));
-        obj_dump(obj_stack_get(0), 0);
-        printf(" ");
-        obj = obj_cdr(obj);
+    PROC_ENTRY(0);
+    static const char* type_names[GARBAGE_OBJ] = {
+        "symbol", "pair", "environment", "prim-form", "prim-proc", "comp-proc", "code", "frame"
+    };
+    obj_gc_stats_t stats;
+    obj_get_gc_stats(&stats);
+
+    obj_t* objs = KNULL;
+    obj_t* bytes = KNULL;
+    int i;
+    for (i = GARBAGE_OBJ - 1; i >= 0; i--) {
+        objs = _acons(type_names[i], obj_make_number(stats.objs_allocated[i]), objs);
+        bytes = _acons(type_names[i], obj_make_number(stats.bytes_allocated[i]), bytes);
     }
-    printf("\n");
-    POPF_RET(KNULL);
+
+    obj_t* result = KNULL;
+    result = _acons("max-vm-stack-objs", obj_make_number(stats.max_vm_stack_objs), result);
+    result = _acons("max-c-stack-bytes", obj_make_number(stats.max_c_stack_bytes), result);
+    result = _acons("free-pages", obj_make_number(stats.free_pages), result);
+    result = _acons("heap-size", obj_make_number(stats.heap_size), result);
+    result = _acons("live-objs", obj_make_number(stats.live_objs), result);
+    result = _acons("total-survivors", obj_make_number(stats.total_survivors), result);
+    result = _acons("last-survivors", obj_make_number(stats.last_survivors), result);
+    result = _acons("bytes-allocated", bytes, result);
+    result = _acons("objs-allocated", objs, result);
+    result = _acons("max-pause-ns", obj_make_number(stats.max_pause_ns), result);
+    result = _acons("total-pause-ns", obj_make_number(stats.total_pause_ns), result);
+    result = _acons("compactions", obj_make_number(stats.num_compactions), result);
+    result = _acons("major-gcs", obj_make_number(stats.num_major_gcs), result);
+    result = _acons("minor-gcs", obj_make_number(stats.num_minor_gcs), result);
+    return result;
 }
 
-obj_t* proc_not(obj_t* obj, obj_t* env)
+// (vm-stack-limit [objs]) returns the limit, after setting it if given one.
+obj_t* proc_vm_stack_limit(int argc, obj_t** argv, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-    obj_t* a = PUSH(obj_car(obj));
-    POPF_RET((a == KNULL || a == KFALSE) ? KTRUE : KFALSE);
+    PROC_ENTRY(0);
+    if (argc > 0) {
+        CHECK_NUMBER(argv[0]);
+        if (obj_number(argv[0]) < 1)
+            obj_error("vm stack limit must be positive");
+        vm_set_stack_limit((int)obj_number(argv[0]));
+    }
+    return obj_make_number(vm_stack_limit());
 }
 
-obj_t* proc_make_environment(obj_t* obj, obj_t* env)
+// like eval, but an error returns its message as a symbol instead of
+// unwinding past the call.
+obj_t* proc_try_eval(int argc, obj_t** argv, obj_t* env)
 {
-    ENTRY_ASSERT();
-    PUSHF();
-    PUSH2(obj, env);
-    POPF_RET(obj_make_environment(KNULL, env));
+    PROC_ENTRY(1);
+    obj_t* eval_env = argc < 2 ? env : argv[1];
+    if (!obj_is_environment(eval_env))
+        obj_error("eval in a non-environment");
+    obj_handler_t handler;
+    if (OBJ_TRY(&handler)) {
+        obj_t* result = vm_eval(argv[0], eval_env);
+        obj_handler_pop(&handler);
+        return result;
+    }
+    return obj_make_symbol(obj_error_message());
 }
@@ -5,6 +5,22 @@
 
 void prim_init();
 
+// interns the symbols the prims use.  prim_init() does this, it's only needed
+// on its own when the prims come from a heap image.
+void prim_init_symbols();
+
+// the prim table by index, heap images store prims by name.  An index is
+// either a proc or a form, prim_func() is NULL for forms and prim_form() for
+// procs.
+int prim_count();
+const char* prim_name(int index);
+prim_func_t prim_func(int index);
+prim_func1_t prim_func1(int index);  // NULL if the proc has no 1 arg entry point
+prim_func2_t prim_func2(int index);  // or 2 arg one
+form_func_t prim_form(int index);
+int prim_index(prim_func_t func);  // -1 if func isn't a prim
+int prim_form_index(form_func_t func);  // -1 if func isn't a prim form
+
 // prim forms
 obj_t* form_define(obj_t* obj, obj_t* env);
 obj_t* form_if(obj_t* obj, obj_t* env);
@@ -14,34 +30,68 @@ obj_t* form_set(obj_t* obj, obj_t* env);
 obj_t* form_begin(obj_t* obj, obj_t* env);
 obj_t* form_lambda(obj_t* obj, obj_t* env);
 
-// prim procs
-obj_t* proc_is_boolean(obj_t* obj, obj_t* env);
-obj_t* proc_is_null(obj_t* obj, obj_t* env);
-obj_t* proc_is_symbol(obj_t* obj, obj_t* env);
-obj_t* proc_is_number(obj_t* obj, obj_t* env);
-obj_t* proc_is_pair(obj_t* obj, obj_t* env);
-obj_t* proc_is_environment(obj_t* obj, obj_t* env);
-obj_t* proc_is_procedure(obj_t* obj, obj_t* env);
-obj_t* proc_is_eq(obj_t* obj, obj_t* env);
-obj_t* proc_is_equal(obj_t* obj, obj_t* env);
-obj_t* proc_cons(obj_t* obj, obj_t* env);
-obj_t* proc_car(obj_t* obj, obj_t* env);
-obj_t* proc_cdr(obj_t* obj, obj_t* env);
-obj_t* proc_set_car(obj_t* obj, obj_t* env);
-obj_t* proc_set_cdr(obj_t* obj, obj_t* env);
-obj_t* proc_add(obj_t* obj, obj_t* env);
-obj_t* proc_sub(obj_t* obj, obj_t* env);
-obj_t* proc_mul(obj_t* obj, obj_t* env);
-obj_t* proc_div(obj_t* obj, obj_t* env);
-obj_t* proc_num_gt(obj_t* obj, obj_t* env);
-obj_t* proc_num_gteq(obj_t* obj, obj_t* env);
-obj_t* proc_num_eq(obj_t* obj, obj_t* env);
-obj_t* proc_num_lt(obj_t* obj, obj_t* env);
-obj_t* proc_num_lteq(obj_t* obj, obj_t* env);
-obj_t* proc_num_abs(obj_t* obj, obj_t* env);
-obj_t* proc_eval(obj_t* obj, obj_t* env);
-obj_t* proc_print(obj_t* obj, obj_t* env);
-obj_t* proc_not(obj_t* obj, obj_t* env);
-obj_t* proc_make_environment(obj_t* obj, obj_t* env);
+// prim procs, argv points into the vm stack
+obj_t* proc_is_boolean(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_null(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_symbol(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_number(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_pair(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_environment(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_procedure(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_eq(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_is_equal(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_cons(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_car(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_cdr(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_set_car(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_set_cdr(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_add(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_sub(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_mul(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_div(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_num_gt(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_num_gteq(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_num_eq(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_num_lt(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_num_lteq(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_num_abs(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_eval(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_print(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_not(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_make_environment(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_gc_stats(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_vm_stack_limit(int argc, obj_t** argv, obj_t* env);
+obj_t* proc_try_eval(int argc, obj_t** argv, obj_t* env);
+
+// their fixed arity entry points, see obj.h.
+obj_t* proc_is_boolean1(obj_t* a);
+obj_t* proc_is_null1(obj_t* a);
+obj_t* proc_is_symbol1(obj_t* a);
+obj_t* proc_is_number1(obj_t* a);
+obj_t* proc_is_pair1(obj_t* a);
+obj_t* proc_is_environment1(obj_t* a);
+obj_t* proc_is_procedure1(obj_t* a);
+obj_t* proc_is_eq2(obj_t* a, obj_t* b);
+obj_t* proc_is_equal2(obj_t* a, obj_t* b);
+obj_t* proc_cons2(obj_t* a, obj_t* b);
+obj_t* proc_car1(obj_t* a);
+obj_t* proc_cdr1(obj_t* a);
+obj_t* proc_set_car2(obj_t* a, obj_t* b);
+obj_t* proc_set_cdr2(obj_t* a, obj_t* b);
+obj_t* proc_add1(obj_t* a);
+obj_t* proc_add2(obj_t* a, obj_t* b);
+obj_t* proc_sub1(obj_t* a);
+obj_t* proc_sub2(obj_t* a, obj_t* b);
+obj_t* proc_mul1(obj_t* a);
+obj_t* proc_mul2(obj_t* a, obj_t* b);
+obj_t* proc_div1(obj_t* a);
+obj_t* proc_div2(obj_t* a, obj_t* b);
+obj_t* proc_num_gt2(obj_t* a, obj_t* b);
+obj_t* proc_num_gteq2(obj_t* a, obj_t* b);
+obj_t* proc_num_eq2(obj_t* a, obj_t* b);
+obj_t* proc_num_lt2(obj_t* a, obj_t* b);
+obj_t* proc_num_lteq2(obj_t* a, obj_t* b);
+obj_t* proc_num_abs1(obj_t* a);
+obj_t* proc_not1(obj_t* a);
 
 #endif
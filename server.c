@@ -0,0 +1,312 @@
+#include "server.h"
+#include "obj.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#define READ_SIZE (64 * 1024)
+#define MAX_PENDING_OUT (1024 * 1024)  // stop reading a client with this much unsent
+
+typedef struct {
+    int fd;
+    char* in;  // received bytes, starting with a partial frame, if any
+    size_t in_len;
+    size_t in_capacity;
+    char* out;  // replies not yet sent, starting at out_pos
+    size_t out_pos;
+    size_t out_len;
+    size_t out_capacity;
+    int eof;
+} client_t;
+
+static volatile sig_atomic_t g_stop = 0;
+
+// results are printed into this, then copied into the reply.
+static FILE* g_print_fp = NULL;
+static char* g_print_buf = NULL;
+static size_t g_print_size = 0;
+
+static void _on_stop_signal(int sig)
+{
+    g_stop = 1;
+}
+
+static void _reserve(char** buf, size_t* capacity, size_t size)
+{
+    if (size <= *capacity)
+        return;
+    size_t new_capacity = *capacity ? *capacity : READ_SIZE;
+    while (new_capacity < size)
+        new_capacity *= 2;
+    *buf = (char*)realloc(*buf, new_capacity);
+    *capacity = new_capacity;
+}
+
+static void _client_reply(client_t* client, int status, const char* data, size_t len)
+{
+    _reserve(&client->out, &client->out_capacity, client->out_len + 5 + len);
+    char* p = client->out + client->out_len;
+    uint32_t frame_len = htonl((uint32_t)(len + 1));
+    memcpy(p, &frame_len, 4);
+    p[4] = (char)status;
+    memcpy(p + 5, data, len);
+    client->out_len += 5 + len;
+}
+
+// str must be null terminated.
+static void _client_eval(client_t* client, const char* str)
+{
+    obj_handler_t handler;
+    if (OBJ_TRY(&handler)) {
+        obj_t* env = obj_make_environment(KNULL, g_env);
+        obj_t* result = obj_eval_str(str, env);
+        obj_handler_pop(&handler);
+
+        fseek(g_print_fp, 0, SEEK_SET);
+        obj_print(result, g_print_fp);
+        fflush(g_print_fp);
+        _client_reply(client, SERVER_OK, g_print_buf, ftell(g_print_fp));
+    } else {
+        const char* message = obj_error_message();
+        _client_reply(client, SERVER_ERROR, message, strlen(message));
+    }
+}
+
+// evaluates every complete request in the input buffer.  Returns 0 if the
+// client sent a bad frame.
+static int _client_eval_frames(client_t* client)
+{
+    size_t pos = 0;
+    while (client->in_len - pos >= 4) {
+        uint32_t frame_len;
+        memcpy(&frame_len, client->in + pos, 4);
+        frame_len = ntohl(frame_len);
+        if (frame_len > SERVER_MAX_FRAME)
+            return 0;
+        if (client->in_len - pos - 4 < frame_len)
+            break;
+
+        // null terminate the request in place, there's always room after the
+        // last byte read.
+        char* str = client->in + pos + 4;
+        char next = str[frame_len];
+        str[frame_len] = 0;
+        _client_eval(client, str);
+        str[frame_len] = next;
+        pos += 4 + frame_len;
+    }
+    memmove(client->in, client->in + pos, client->in_len - pos);
+    client->in_len -= pos;
+    return 1;
+}
+
+// returns 0 if the client should be closed.
+static int _client_read(client_t* client)
+{
+    _reserve(&client->in, &client->in_capacity, client->in_len + READ_SIZE + 1);
+    ssize_t len = read(client->fd, client->in + client->in_len, READ_SIZE);
+    if (len < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (len == 0) {
+        client->eof = 1;
+        return 1;
+    }
+    client->in_len += len;
+    return _client_eval_frames(client);
+}
+
+// returns 0 if the client should be closed.
+static int _client_write(client_t* client)
+{
+    while (client->out_pos < client->out_len) {
+        ssize_t len = write(client->fd, client->out + client->out_pos,
+                            client->out_len - client->out_pos);
+        if (len < 0)
+            return errno == EAGAIN || errno == EINTR;
+        client->out_pos += len;
+    }
+    client->out_pos = 0;
+    client->out_len = 0;
+    return 1;
+}
+
+static void _client_close(client_t* client)
+{
+    close(client->fd);
+    free(client->in);
+    free(client->out);
+}
+
+static void _serve(int listen_fd)
+{
+    g_print_fp = open_memstream(&g_print_buf, &g_print_size);
+
+    client_t* clients = NULL;
+    struct pollfd* fds = NULL;
+    int num_clients = 0;
+    int capacity = 0;
+    while (!g_stop) {
+        if (capacity < num_clients + 1) {
+            capacity = capacity ? capacity * 2 : 16;
+            clients = (client_t*)realloc(clients, sizeof(client_t) * capacity);
+            fds = (struct pollfd*)realloc(fds, sizeof(struct pollfd) * capacity);
+        }
+
+        // fds[0] is the listening socket, fds[i + 1] is clients[i].
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        int i;
+        for (i = 0; i < num_clients; i++) {
+            client_t* client = &clients[i];
+            fds[i + 1].fd = client->fd;
+            fds[i + 1].events = 0;
+            if (!client->eof && client->out_len - client->out_pos < MAX_PENDING_OUT)
+                fds[i + 1].events |= POLLIN;
+            if (client->out_pos < client->out_len)
+                fds[i + 1].events |= POLLOUT;
+        }
+        if (poll(fds, num_clients + 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (i = num_clients - 1; i >= 0; i--) {
+            client_t* client = &clients[i];
+            short revents = fds[i + 1].revents;
+            int ok = 1;
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                ok = _client_read(client);
+            if (ok && client->out_pos < client->out_len)
+                ok = _client_write(client);
+            if (!ok || (client->eof && client->out_pos == client->out_len)) {
+                _client_close(client);
+                clients[i] = clients[--num_clients];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            // with several workers another one may have taken it already.
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                client_t* client = &clients[num_clients++];
+                memset(client, 0, sizeof(client_t));
+                client->fd = fd;
+            }
+        }
+    }
+
+    int i;
+    for (i = 0; i < num_clients; i++)
+        _client_close(&clients[i]);
+    free(clients);
+    free(fds);
+    fclose(g_print_fp);
+    free(g_print_buf);
+}
+
+static int _listen(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path \"%s\" is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// returns the worker's pid, or -1 if it couldn't be forked.
+static pid_t _fork_worker(int listen_fd)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+    } else if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        _serve(listen_fd);
+        exit(0);
+    }
+    return pid;
+}
+
+int server_run(const char* path, int num_workers)
+{
+    int listen_fd = _listen(path);
+    if (listen_fd < 0)
+        return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _on_stop_signal;  // no SA_RESTART, so poll and waitpid return
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (num_workers <= 0) {
+        _serve(listen_fd);
+    } else {
+        obj_prepare_fork();
+
+        pid_t* pids = (pid_t*)malloc(sizeof(pid_t) * num_workers);
+        int i;
+        for (i = 0; i < num_workers; i++) {
+            pids[i] = _fork_worker(listen_fd);
+            if (pids[i] < 0)
+                break;
+        }
+        num_workers = i;
+
+        // a worker that dies is replaced, the new one is forked from the
+        // same prepared heap.
+        while (!g_stop) {
+            pid_t pid = waitpid(-1, NULL, 0);
+            if (pid < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;  // no workers left, they couldn't be forked again
+            }
+            for (i = 0; i < num_workers && !g_stop; i++)
+                if (pids[i] == pid)
+                    pids[i] = _fork_worker(listen_fd);
+        }
+        for (i = 0; i < num_workers; i++)
+            if (pids[i] > 0)
+                kill(pids[i], SIGTERM);
+        while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+            ;
+        free(pids);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    return 0;
+}
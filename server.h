@@ -0,0 +1,24 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// eval server on a unix domain socket.
+//
+// Requests and replies are frames, a 4 byte big-endian length followed by
+// that many bytes.  A request is the text of one s-expression, it's evaluated
+// in a fresh env whose parent is g_env.  A reply is a status byte, 0 for ok or
+// 1 for an error, followed by the printed result or the error message.
+//
+// Replies come back in request order, so clients can pipeline.  Every
+// complete request in a read is evaluated before the replies are written, so
+// requests sent together are batched and their replies written together.
+//
+// Serves until SIGINT or SIGTERM, from num_workers forked processes sharing
+// the heap, or from this process if num_workers is 0.  Returns non-zero if
+// the socket couldn't be set up.
+int server_run(const char* path, int num_workers);
+
+#define SERVER_OK 0
+#define SERVER_ERROR 1
+#define SERVER_MAX_FRAME (16 * 1024 * 1024)
+
+#endif
@@ -3,36 +3,151 @@
 #include <string.h>
 #include <stdlib.h>
 
-// global interned symbol array.
-#define MAX_SYMBOLS 1000
-static const char* g_symbol_array[MAX_SYMBOLS];
-static int g_symbol_len_array[MAX_SYMBOLS];
+// symbol names are stored back to back in a chain of arena blocks,
+// blocks are never moved or freed so symbol_get() pointers stay valid.
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct arena_block_struct {
+    struct arena_block_struct* next;
+    int size;
+    int used;
+    char data[];
+} arena_block_t;
+
+static arena_block_t* g_arena = NULL;
+
+typedef struct {
+    const char* str;
+    int len;
+    unsigned int hash;
+} symbol_entry_t;
+
+// global interned symbol array, indexed by symbol id.
+static symbol_entry_t* g_symbol_array = NULL;
+static int g_symbol_array_capacity = 0;
 static int g_num_symbols = 0;
 
-const char* symbol_get(int id)
+// open addressing hash table of symbol ids, -1 is an empty slot.
+// the table size is always a power of two and kept at most half full.
+#define INITIAL_TABLE_SIZE 1024
+static int* g_symbol_table = NULL;
+static int g_symbol_table_size = 0;
+
+// FNV-1a
+static unsigned int _hash(const char* str, int len)
 {
-    assert(id >= 0 && id < MAX_SYMBOLS);
-    return g_symbol_array[id];
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-int symbol_find(const char* str, int len)
+static const char* _arena_copy(const char* str, int len)
 {
-    int i;
-    for (i = 0; i < g_num_symbols; i++) {
-        if (len == g_symbol_len_array[i] && strncmp(g_symbol_array[i], str, len) == 0)
-            return i;
+    if (!g_arena || g_arena->used + len + 1 > g_arena->size) {
+        int size = len + 1 > ARENA_BLOCK_SIZE ? len + 1 : ARENA_BLOCK_SIZE;
+        arena_block_t* block = (arena_block_t*)malloc(sizeof(arena_block_t) + size);
+        assert(block);
+        block->next = g_arena;
+        block->size = size;
+        block->used = 0;
+        g_arena = block;
+    }
+    char* symbol_string = g_arena->data + g_arena->used;
+    memcpy(symbol_string, str, len);
+    symbol_string[len] = 0;
+    g_arena->used += len + 1;
+    return symbol_string;
+}
+
+static void _table_insert(int id)
+{
+    unsigned int mask = g_symbol_table_size - 1;
+    unsigned int i = g_symbol_array[id].hash & mask;
+    while (g_symbol_table[i] >= 0)
+        i = (i + 1) & mask;
+    g_symbol_table[i] = id;
+}
+
+static void _table_grow()
+{
+    free(g_symbol_table);
+    g_symbol_table_size = g_symbol_table_size ? g_symbol_table_size * 2 : INITIAL_TABLE_SIZE;
+    g_symbol_table = (int*)malloc(sizeof(int) * g_symbol_table_size);
+    assert(g_symbol_table);
+    memset(g_symbol_table, 0xff, sizeof(int) * g_symbol_table_size);
+
+    int id;
+    for (id = 0; id < g_num_symbols; id++)
+        _table_insert(id);
+}
+
+static int _find(const char* str, int len, unsigned int hash)
+{
+    if (!g_symbol_table)
+        return -1;
+
+    unsigned int mask = g_symbol_table_size - 1;
+    unsigned int i = hash & mask;
+    while (g_symbol_table[i] >= 0) {
+        symbol_entry_t* entry = g_symbol_array + g_symbol_table[i];
+        if (entry->hash == hash && entry->len == len && memcmp(entry->str, str, len) == 0)
+            return g_symbol_table[i];
+        i = (i + 1) & mask;
     }
     return -1;
 }
 
+static int _add(const char* str, int len, unsigned int hash)
+{
+    if (g_num_symbols == g_symbol_array_capacity) {
+        g_symbol_array_capacity = g_symbol_array_capacity ? g_symbol_array_capacity * 2 : INITIAL_TABLE_SIZE;
+        g_symbol_array = (symbol_entry_t*)realloc(g_symbol_array, sizeof(symbol_entry_t) * g_symbol_array_capacity);
+        assert(g_symbol_array);
+    }
+
+    int id = g_num_symbols++;
+    g_symbol_array[id].str = _arena_copy(str, len);
+    g_symbol_array[id].len = len;
+    g_symbol_array[id].hash = hash;
+
+    if (g_num_symbols * 2 > g_symbol_table_size)
+        _table_grow();  // re-inserts every id, including this one.
+    else
+        _table_insert(id);
+
+    return id;
+}
+
+const char* symbol_get(int id)
+{
+    assert(id >= 0 && id < g_num_symbols);
+    return g_symbol_array[id].str;
+}
+
+int symbol_find(const char* str, int len)
+{
+    return _find(str, len, _hash(str, len));
+}
+
 int symbol_add(const char* str, int len)
 {
-    assert(g_num_symbols < MAX_SYMBOLS);
-    char* symbol_string = (char*)malloc(len + 1);
-    memcpy(symbol_string, str, len);
-    symbol_string[len] = 0;
-    g_symbol_array[g_num_symbols] = symbol_string;
-    g_symbol_len_array[g_num_symbols] = len;
-    g_num_symbols++;
-    return g_num_symbols - 1;
+    return _add(str, len, _hash(str, len));
+}
+
+int symbol_intern(const char* str, int len)
+{
+    unsigned int hash = _hash(str, len);
+    int id = _find(str, len, hash);
+    if (id < 0)
+        id = _add(str, len, hash);
+    return id;
+}
+
+int symbol_count()
+{
+    return g_num_symbols;
 }
@@ -5,5 +5,7 @@
 int symbol_add(const char* str, int len);
 const char* symbol_get(int id);
 int symbol_find(const char* str, int len);
+int symbol_intern(const char* str, int len);  // find or add, hashes only once.
+int symbol_count();
 
 #endif
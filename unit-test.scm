@@ -24,6 +24,15 @@
 (assert '(eq? 10 (quote 10)))
 (assert '(eq? #t (quote #t)))
 
+;; quasiquote
+(define two 2)
+(assert '(equal? '(1 2 3) `(1 ,two 3)))
+(assert '(equal? '(1 (+ 1 1) . 3) `(1 (+ 1 1) . 3)))
+(assert '(eq? 'foo `foo))
+
+;; forms that are only known to be forms when they're called
+(assert '(eq? 1 ((car (cons if ())) #t 1 2)))
+
 ;; set
 (define xxx 10)
 (set! xxx 20)
@@ -174,9 +183,18 @@
 (assert '(<= 2 (+ 1 1)))
 (assert '(= (+ 1 1) 2))
 
+;; numbers are immediate
+(assert '(eq? (- 0 2.5) -2.5))
+(assert '(number? (/ 0 0)))
+(assert '(not (eq? (/ 0 0) (/ 0 0))))
+
 ;; math functions
 (assert '(eq? (abs -2) 2))
 
+;; prims with fixed arity entry points still ignore extra args
+(assert '(eq? 1 (car '(1 2) 'extra)))
+(assert '(eq? #t (< 1 2 'extra)))
+
 ;; not
 (assert (not #f))
 (assert (not ()))
@@ -190,3 +208,127 @@
 (assert '(eq? #t (eval #t)))
 (assert '(eq? 10 (eval '(+ 5 5))))
 
+
+;; deep non-tail recursion
+(define count-down (lambda (n) (if (= n 0) () (cons n (count-down (- n 1))))))
+(define list-length (lambda (l) (if (null? l) 0 (+ 1 (list-length (cdr l))))))
+(assert '(eq? 500 (list-length (count-down 500))))
+(assert '(eq? 100000 (list-length (count-down 100000))))
+
+;; past a lowered vm stack limit, recursion is an error that try-eval recovers from
+(define vm-limit (vm-stack-limit))
+(assert '(eq? 10000 (vm-stack-limit 10000)))
+(assert '(symbol? (try-eval '(count-down 100000))))
+(assert '(eq? vm-limit (vm-stack-limit vm-limit)))
+(assert '(eq? 100000 (list-length (count-down 100000))))
+(assert '(eq? 3 (try-eval '(+ 1 2))))
+
+;; closures see the env they were made in
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+(assert '(eq? 7 ((make-adder 3) 4)))
+
+;; locals live in frame slots, set! and define in a body write them
+(define make-counter (lambda () (begin (define n 0) (lambda () (begin (set! n (+ n 1)) n)))))
+(define counter (make-counter))
+(counter)
+(assert '(eq? 2 (counter)))
+(assert '(eq? 1 ((make-counter))))
+(define shadow (lambda (x) (begin (define x (+ x 1)) (set! x (* x 2)))))
+(assert '(eq? 4 (shadow 3)))
+(define last-wins (lambda (a a) a))
+(assert '(eq? 2 (last-wins 1 2)))
+
+;; eval sees locals by name, and defines names that aren't locals in the frame
+(define see-local (lambda (x) (eval '(+ x 1))))
+(assert '(eq? 11 (see-local 10)))
+(define eval-define (lambda (x) (begin (eval '(define y (* x 2))) (eval 'y))))
+(assert '(eq? 6 (eval-define 3)))
+
+;; refs cache where they found a name, until a define hides it
+(define shenv (make-environment))
+(eval '(define shf (lambda (l) (car l))) shenv)
+(assert '(eq? 1 (eval '(shf '(1 2)) shenv)))
+(eval '(define car cdr) shenv)
+(assert '(equal? '(2) (eval '(shf '(1 2)) shenv)))
+(define shadow-frame (lambda (x) (begin (if x (eval '(define car cdr))) (lambda (l) (car l)))))
+(define sfa (shadow-frame #t))
+(define sfb (shadow-frame #f))
+(assert '(eq? 1 (sfb '(1 2))))
+(assert '(equal? '(2) (sfa '(1 2))))
+(assert '(eq? 1 (sfb '(1 2))))
+(define shadow-frame2 (lambda (x) (begin (if x (eval '(define cdr car))) (lambda (l) (cdr l)))))
+(define sfc (shadow-frame2 #f))
+(assert '(equal? '(2) (sfc '(1 2))))
+(define sfd (shadow-frame2 #t))
+(assert '(eq? 1 (sfd '(1 2))))
+(assert '(equal? '(2) (sfc '(1 2))))
+
+;; a local is never a form, even if it's named like one
+(define not-a-form (lambda (if) (if 1 2)))
+(assert '(eq? 3 (not-a-form +)))
+(define form-arg (lambda (f) (f #t 1 2)))
+(assert '(eq? 1 (form-arg if)))
+(define form-side-effects (cons 0 ()))
+(define form-side-arg (lambda (f) (f #t 1 (set-car! form-side-effects 1))))
+(assert '(eq? 1 (form-side-arg if)))
+(assert '(eq? 0 (car form-side-effects)))
+
+;; tail calls run in constant c and vm stack, the deep recursion above went deeper
+(define stat (lambda (key stats) (if (eq? key (car (car stats))) (cdr (car stats)) (stat key (cdr stats)))))
+(define c-stack-bytes (stat 'max-c-stack-bytes (gc-stats)))
+(define vm-stack-objs (stat 'max-vm-stack-objs (gc-stats)))
+(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1)))))
+(define begin-loop (lambda (n) (begin 'ignored (if (= n 0) 'done (begin-loop (- n 1))))))
+(assert '(eq? 5000 (loop 5000 0)))
+(assert '(eq? 'done (begin-loop 5000)))
+(assert '(eq? c-stack-bytes (stat 'max-c-stack-bytes (gc-stats))))
+(assert '(eq? vm-stack-objs (stat 'max-vm-stack-objs (gc-stats))))
+
+;; prim calls cons nothing but their result
+(define pairs-allocated (lambda () (stat 'pair (stat 'objs-allocated (gc-stats)))))
+(define prim-loop (lambda (n p) (if (= n 0) 'done (begin (car p) (eq? (cdr p) (not p)) (prim-loop (- n 1) p)))))
+(define pairs-before (pairs-allocated))
+(prim-loop 1000 '(1 . 2))
+(assert '(< (- (pairs-allocated) pairs-before) 1000))
+
+;; hot numeric procs are compiled by the jit, and give what the vm would
+(define jfib (lambda (n) (if (< n 2) n (+ (jfib (- n 1)) (jfib (- n 2))))))
+(define jsum (lambda (n acc) (if (not (> n 0)) acc (jsum (- n 1) (+ acc n)))))
+(assert '(eq? 6765 (jfib 20)))
+(assert '(eq? 50005000 (jsum 10000 0)))
+(assert '(eq? -3 (jsum 0 -3)))
+
+;; args that aren't numbers run on the vm
+(define jfirst (lambda (a b) (if (< 0 1) a b)))
+(define jrepeat (lambda (n) (if (= n 0) (jfirst 1 2) (begin (jfirst 1 2) (jrepeat (- n 1))))))
+(assert '(eq? 1 (jrepeat 2000)))
+(assert '(eq? 'x (jfirst 'x 1)))
+
+;; so do procs whose prims have been rebound since
+(define jenv (make-environment))
+(eval '(define jinc (lambda (x) (+ x 1))) jenv)
+(eval '(define jrepeat (lambda (n) (if (= n 0) (jinc 1) (begin (jinc 1) (jrepeat (- n 1)))))) jenv)
+(assert '(eq? 2 (eval '(jrepeat 2000) jenv)))
+(eval '(define + -) jenv)
+(assert '(eq? 0 (eval '(jinc 1) jenv)))
+
+;; or whose own local binding has been set! since
+(define jlocal (lambda (n) (begin (define jl (lambda (i) (if (= i 0) 0 (jl (- i 1)))))
+                                  (define old jl) (jl n) (set! jl (lambda (i) 'replaced)) (old 5))))
+(assert '(eq? 'replaced (jlocal 2000)))
+
+;; closures of the same code check their own outer locals, even ones made
+;; where a dead one was
+(define jmake (lambda (op) (lambda (n) (op n 1))))
+(define jboth (lambda (n acc) (if (= n 0) acc (jboth (- n 1) (+ acc ((jmake +) n) ((jmake -) n))))))
+(assert '(eq? 9003000 (jboth 3000 0)))
+
+;; native recursion deeper than the c stack falls back to the vm
+(define jdeep (lambda (n) (if (= n 0) 0 (+ 1 (jdeep (- n 1))))))
+(assert '(eq? 2000 (jdeep 2000)))
+(assert '(eq? 100000 (jdeep 100000)))
+
+;; gc-stats
+(assert '(pair? (gc-stats)))
+(assert '(eq? 'minor-gcs (car (car (gc-stats)))))
+(assert '(number? (cdr (car (gc-stats)))))
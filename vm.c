@@ -0,0 +1,331 @@
+#include "vm.h"
+#include "compile.h"
+#include "jit.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// the stack is mmap'd up front, pages are only touched as it gets deep.
+#define VM_STACK_OBJS (1024 * 1024)
+
+// a call pushes the caller's code, pc and env.  The bottom frame of a
+// vm_run() has () for code.
+#define FRAME_OBJS 3
+
+// pcs are pushed as immediates, so gc skips them.
+#define PC_OBJ(OFFSET) ((obj_t*)(((uintptr_t)(OFFSET) << 8) | UNUSED2_TAG | IMM_TAG))
+#define PC_OFFSET(OBJ) ((uintptr_t)(OBJ) >> 8)
+
+#define U16(P) ((P)[0] | (P)[1] << 8)
+#define U32(P) ((uint32_t)(P)[0] | (uint32_t)(P)[1] << 8 | (uint32_t)(P)[2] << 16 | (uint32_t)(P)[3] << 24)
+
+obj_t** g_vm_stack = NULL;
+obj_t** g_vm_sp = NULL;
+static obj_t** g_vm_stack_end = NULL;
+static obj_t** g_vm_max_sp = NULL;
+static int g_vm_stack_objs = VM_STACK_OBJS;  // mapped
+static int g_vm_stack_limit = VM_STACK_OBJS;
+
+void vm_init()
+{
+    if (g_vm_stack)
+        return;
+    g_vm_stack_objs = g_vm_stack_limit;
+    void* p = mmap(NULL, sizeof(obj_t*) * g_vm_stack_objs, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "ERROR: couldn't map the vm stack\n");
+        abort();
+    }
+    g_vm_stack = (obj_t**)p;
+    g_vm_sp = g_vm_stack;
+    g_vm_stack_end = g_vm_stack + g_vm_stack_limit;
+    g_vm_max_sp = g_vm_stack;
+}
+
+void vm_set_stack_limit(int max_objs)
+{
+    assert(max_objs > 0);
+    if (g_vm_stack && max_objs > g_vm_stack_objs)
+        max_objs = g_vm_stack_objs;
+    g_vm_stack_limit = max_objs;
+    if (g_vm_stack)
+        g_vm_stack_end = g_vm_stack + max_objs;
+}
+
+int vm_stack_limit()
+{
+    return g_vm_stack_limit;
+}
+
+int vm_max_depth()
+{
+    return (int)(g_vm_max_sp - g_vm_stack);
+}
+
+// errors unless code with sp at its bottom has room to run.
+static void _check_stack(obj_t** sp, bytecode_t* bytecode)
+{
+    obj_t** top = sp + bytecode->max_stack + FRAME_OBJS;
+    if (top > g_vm_stack_end)
+        obj_error("vm stack overflow, recursion is too deep");
+    if (top > g_vm_max_sp)
+        g_vm_max_sp = top;
+}
+
+// an OP_REF's symbol can't be a local, the compiler would have said.  So it's
+// found past the frames of the lambdas its code is in, which are new each call,
+// in what's the same for every run of the code, and where it's found is cached
+// until g_env_cells_epoch changes, see obj_env_cache_cell().
+static obj_t* _ref_miss(ref_cache_t* cache, obj_t* env, obj_t* symbol)
+{
+    obj_t** cell = obj_env_cache_cell(env, symbol);
+    if (!cell)
+        return obj_env_lookup(env, symbol);
+    cache->cell = cell;
+    cache->epoch = g_env_cells_epoch;
+    return *cell;
+}
+
+// the frame depth parents up from env.
+static obj_t* _frame_up(obj_t* env, int depth)
+{
+    while (depth--)
+        env = env->data.frame.parent;
+    return env;
+}
+
+// dispatch is threaded, each op jumps straight to the next one's label.
+#define NEXT goto *s_labels[*pc++]
+
+// before anything that might gc or error.
+#define SYNC() (g_vm_sp = sp)
+
+// loads the registers for code, starting at offset.
+#define ENTER(CODE, OFFSET)                         \
+    do {                                            \
+        code = (CODE);                              \
+        bytecode = code->data.code.bytecode;        \
+        consts = bytecode->consts;                  \
+        caches = BYTECODE_CACHES(bytecode);         \
+        ops = BYTECODE_OPS(bytecode);               \
+        pc = ops + (OFFSET);                        \
+    } while (0)
+
+obj_t* vm_run(obj_t* code, obj_t* env)
+{
+    static void* s_labels[NUM_OPS] = {
+        [OP_CONST] = &&op_const,
+        [OP_REF] = &&op_ref,
+        [OP_DEFINE] = &&op_define,
+        [OP_SET] = &&op_set,
+        [OP_LOCAL] = &&op_local,
+        [OP_SET_LOCAL] = &&op_set_local,
+        [OP_DEFINE_LOCAL] = &&op_define_local,
+        [OP_POP] = &&op_pop,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMP_IF_FALSE] = &&op_jump_if_false,
+        [OP_LAMBDA] = &&op_lambda,
+        [OP_CONS] = &&op_cons,
+        [OP_FORM] = &&op_form,
+        [OP_CALL] = &&op_call,
+        [OP_TAIL_CALL] = &&op_call,
+        [OP_RETURN] = &&op_return,
+    };
+
+    // vm_run() is reentered from prims like eval, those do recurse.
+    obj_check_c_stack();
+    assert(obj_is_code(code));
+
+    obj_t** sp = g_vm_sp;
+    bytecode_t* bytecode;
+    obj_t** consts;
+    ref_cache_t* caches;
+    unsigned char* ops;
+    unsigned char* pc;
+    ENTER(code, 0);
+    _check_stack(sp, bytecode);
+    *sp++ = KNULL;
+    *sp++ = PC_OBJ(0);
+    *sp++ = env;
+    NEXT;
+
+op_const:
+    *sp++ = consts[U16(pc)];
+    pc += 2;
+    NEXT;
+
+op_ref:
+{
+    ref_cache_t* cache = caches + U16(pc + 2);
+    if (cache->epoch == g_env_cells_epoch)
+        *sp++ = *cache->cell;
+    else
+        *sp++ = _ref_miss(cache, env, consts[U16(pc)]);
+    pc += 4;
+    NEXT;
+}
+
+op_define:
+    SYNC();
+    obj_env_define(env, consts[U16(pc)], sp[-1]);
+    sp[-1] = consts[U16(pc)];
+    pc += 2;
+    NEXT;
+
+op_set:
+{
+    SYNC();
+    obj_t* old_value = obj_env_lookup(env, consts[U16(pc)]);
+    obj_env_define(env, consts[U16(pc)], sp[-1]);
+    sp[-1] = old_value;
+    pc += 2;
+    NEXT;
+}
+
+op_local:
+    *sp++ = _frame_up(env, U16(pc))->data.frame.slots[U16(pc + 2)];
+    pc += 4;
+    NEXT;
+
+op_set_local:
+{
+    obj_t* frame = _frame_up(env, U16(pc));
+    obj_t* old_value = frame->data.frame.slots[U16(pc + 2)];
+    obj_frame_set(frame, U16(pc + 2), sp[-1]);
+    sp[-1] = old_value;
+    pc += 4;
+    NEXT;
+}
+
+op_define_local:
+    obj_frame_set(env, U16(pc), sp[-1]);
+    sp[-1] = consts[U16(pc + 2)];
+    pc += 4;
+    NEXT;
+
+op_pop:
+    sp--;
+    NEXT;
+
+op_jump:
+    pc = ops + U32(pc);
+    NEXT;
+
+op_jump_if_false:
+{
+    obj_t* value = *--sp;
+    if (value == KFALSE || value == KNULL)
+        pc = ops + U32(pc);
+    else
+        pc += 4;
+    NEXT;
+}
+
+op_lambda:
+{
+    SYNC();
+    obj_t* proc = obj_make_comp_proc(consts[U16(pc)], env, consts[U16(pc + 2)]);
+    *sp++ = proc;
+    pc += 4;
+    NEXT;
+}
+
+op_cons:
+{
+    SYNC();
+    obj_t* pair = obj_cons(sp[-2], sp[-1]);
+    sp--;
+    sp[-1] = pair;
+    NEXT;
+}
+
+op_form:
+{
+    obj_t* f = sp[-1];
+    if (!obj_is_immediate(f) && obj_get_type(f) == PRIM_FORM_OBJ) {
+        SYNC();
+        sp[-1] = f->data.form_func(consts[U16(pc)], env);
+        pc = ops + U32(pc + 2);
+    } else {
+        pc += 6;
+    }
+    NEXT;
+}
+
+op_call:
+{
+    int tail = pc[-1] == OP_TAIL_CALL;
+    int argc = U16(pc);
+    obj_t** argv = sp - argc;
+    obj_t* f = argv[-1];
+    obj_t* result;
+    SYNC();
+    if (obj_is_immediate(f))
+        obj_error("f is not a procedure or form");
+    switch (obj_get_type(f)) {
+    case PRIM_PROC_OBJ:
+        if (argc == 2 && f->data.prim_proc.func2)
+            result = f->data.prim_proc.func2(argv[0], argv[1]);
+        else if (argc == 1 && f->data.prim_proc.func1)
+            result = f->data.prim_proc.func1(argv[0]);
+        else
+            result = f->data.prim_proc.func(argc, argv, env);
+        break;
+    case COMP_PROC_OBJ:
+    {
+        bytecode_t* callee = f->data.comp_proc.body->data.code.bytecode;
+        if (callee->calls < g_jit_threshold)
+            callee->calls++;
+        else if (g_jit_threshold && jit_call(f, argc, argv, &result))
+            break;
+        if (argc < callee->num_args)
+            obj_error("too few args");
+        obj_t* callee_env = obj_make_frame(f->data.comp_proc.env, callee->consts[callee->names],
+                                           callee->num_locals, callee->num_args, argv);
+        sp = argv - 1;
+        if (!tail) {
+            *sp++ = code;
+            *sp++ = PC_OBJ(pc + 4 - ops);
+            *sp++ = env;
+        }
+        env = callee_env;
+        ENTER(f->data.comp_proc.body, 0);
+        _check_stack(sp - FRAME_OBJS, bytecode);
+        NEXT;
+    }
+    case PRIM_FORM_OBJ:
+        result = f->data.form_func(consts[U16(pc + 2)], env);
+        break;
+    default:
+        obj_error("f is not a procedure or form");
+    }
+    sp = argv;
+    sp[-1] = result;
+    pc += 4;
+    if (!tail)
+        NEXT;
+    // fall thru to return the result
+}
+
+op_return:
+{
+    obj_t* result = sp[-1];
+    sp -= 1 + FRAME_OBJS;
+    if (obj_is_null(sp[0])) {
+        g_vm_sp = sp;
+        return result;
+    }
+    env = sp[2];
+    ENTER(sp[0], PC_OFFSET(sp[1]));
+    sp[0] = result;
+    sp++;
+    NEXT;
+}
+}
+
+obj_t* vm_eval(obj_t* expr, obj_t* env)
+{
+    return vm_run(compile(expr, env), env);
+}
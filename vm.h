@@ -0,0 +1,58 @@
+#ifndef VM_H
+#define VM_H
+
+#include "obj.h"
+
+// the bytecode vm.  Code works on a stack of objs.  An op is a byte followed
+// by its operands, 16 bit const indices and counts, and 32 bit offsets into
+// the ops, all little endian.
+//
+// Calling a comp_proc doesn't recurse on the C stack.  The caller's code, pc
+// and env are pushed as a frame, then the callee's code runs until its
+// return pops the frame.  A tail call reuses the caller's frame, so a tail
+// recursive loop runs in constant stack.  Prim procs get their args where
+// they are, argv points into the stack.  A comp_proc's args are copied into
+// the frame_t that is the env of its call, see compile.h.
+enum vm_op {
+    OP_CONST,          // k: pushes consts[k]
+    OP_REF,            // k c: pushes the value of the symbol consts[k], c is its cache
+    OP_DEFINE,         // k: binds consts[k] to the popped value, pushes consts[k]
+    OP_SET,            // k: binds consts[k] to the popped value, pushes the old value
+    OP_LOCAL,          // d i: pushes slot i of the frame d parents up from the env
+    OP_SET_LOCAL,      // d i: sets that slot to the popped value, pushes the old value
+    OP_DEFINE_LOCAL,   // i k: sets slot i of the env to the popped value, pushes consts[k]
+    OP_POP,
+    OP_JUMP,           // t: continues at offset t
+    OP_JUMP_IF_FALSE,  // t: pops, and jumps if that was #f or ()
+    OP_LAMBDA,         // k c: pushes a comp_proc with formals consts[k] and body consts[c]
+    OP_CONS,           // pops the cdr then the car, pushes the pair
+    OP_FORM,           // k t: if the top is a prim form, replaces it with what the form
+                       //      returns for the args consts[k] and jumps to t
+    OP_CALL,           // n k: calls the proc under the top n args, with them.  If it's a
+                       //      prim form it gets consts[k], the args unevaluated, instead
+    OP_TAIL_CALL,      // n k: same, for a call in tail context
+    OP_RETURN,         // returns the top
+    NUM_OPS
+};
+
+// the stack is a gc root from g_vm_stack up to g_vm_sp.  The vm keeps its
+// stack pointer in a local and stores it to g_vm_sp before anything that can
+// gc or error, an error handler restores it.
+extern obj_t** g_vm_stack;
+extern obj_t** g_vm_sp;
+
+void vm_init();
+
+// both may trigger a gc.
+obj_t* vm_run(obj_t* code, obj_t* env);
+obj_t* vm_eval(obj_t* expr, obj_t* env);  // compiles expr, then runs it
+
+int vm_max_depth();  // high water mark of the stack, in objs
+
+// code that would run the stack past max_objs objs errors out with a vm stack
+// overflow instead.  defaults to 1048576.  Before vm_init() it sets how much
+// stack is mapped, after it can be lowered and raised back up to that.
+void vm_set_stack_limit(int max_objs);
+int vm_stack_limit();
+
+#endif